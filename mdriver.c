@@ -20,6 +20,7 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <math.h>
+#include <pthread.h>
 
 #include "mm.h"
 #include "memlib.h"
@@ -43,6 +44,9 @@
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((unsigned long)(p)) % ALIGNMENT) == 0)
 
+/* Returns true if p is a-byte aligned (a is a power of 2) */
+#define IS_ALIGNED_TO(p, a)  ((((unsigned long)(p)) & ((a) - 1)) == 0)
+
 /* weights */
 typedef enum { WNONE, WALL, WUTIL, WPERF } weight_t;
 
@@ -80,9 +84,10 @@ typedef struct {
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-    enum { ALLOC, FREE, REALLOC } type; /* type of request */
+    enum { ALLOC, FREE, REALLOC, MEMALIGN } type; /* type of request */
     long index;                         /* index for free() to use later */
     size_t size;                        /* byte size of alloc/realloc request */
+    size_t alignment;                   /* alignment of memalign request */
 } traceop_t;
 
 /* Holds the information for one trace file */
@@ -164,6 +169,15 @@ static size_t maxfill = MAXFILL;
 /* by default, no timeouts */
 static int set_timeout = 0;
 
+/* Threads of the producer/consumer stress test, 0 runs the traces (set by -S) */
+static int stress_threads = 0;
+
+/* Blocks per batch of the batch test, 0 runs the traces (set by -B) */
+static int batch_blocks = 0;
+
+/* Rounds of the aligned allocation test, 0 runs the traces (set by -A) */
+static int align_rounds = 0;
+
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
@@ -213,6 +227,15 @@ static void free_trace(trace_t *trace);
 static bool eval_libc_valid(trace_t *trace);
 static void eval_libc_speed(void *ptr);
 
+/* Multithreaded stress test */
+static int run_stress_test(int num_threads);
+
+/* Batch malloc/free test */
+static int run_batch_test(int num_blocks);
+
+/* Aligned allocation test */
+static int run_align_test(int rounds);
+
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges);
@@ -356,7 +379,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hOVlDT")) != EOF) {
+    while ((c = getopt(argc, argv, "d:f:c:s:t:v:S:B:A:hOVlDT")) != EOF) {
         switch (c) {
 
             case 'f': /* Use one specific trace file only (relative to curr dir) */
@@ -406,6 +429,18 @@ int main(int argc, char **argv)
                 tab_mode = true;
                 break;
 
+            case 'S': /* Run the multithreaded stress test */
+                stress_threads = atoi(optarg);
+                break;
+
+            case 'B': /* Run the batch malloc/free test */
+                batch_blocks = atoi(optarg);
+                break;
+
+            case 'A': /* Run the aligned allocation test */
+                align_rounds = atoi(optarg);
+                break;
+
             case 'h': /* Print this message */
                 usage(argv[0]);
                 exit(0);
@@ -417,6 +452,18 @@ int main(int argc, char **argv)
     }
 #endif /* !REF_ONLY */
 
+    if (stress_threads > 0) {
+        exit(run_stress_test(stress_threads) == 0 ? 0 : 1);
+    }
+
+    if (batch_blocks > 0) {
+        exit(run_batch_test(batch_blocks) == 0 ? 0 : 1);
+    }
+
+    if (align_rounds > 0) {
+        exit(run_align_test(align_rounds) == 0 ? 0 : 1);
+    }
+
     if (num_global_tracefiles == 0) {
         int i;
         for (i = 0; default_tracefiles[i]; i++)
@@ -698,13 +745,25 @@ static range_set_t *new_range_set() {
  *     we've just called the student's mm_malloc to allocate a block of
  *     size bytes at addr lo. After checking the block for correctness,
  *     we create a range struct for this block and add it to the range list.
+ *     The range is the whole mm_malloc_usable_size of the block, the
+ *     caller may use all of it.
  */
 static bool add_range(range_set_t *ranges, char *lo, size_t size,
                       const trace_t *trace, int opnum, int index) {
-    char *hi = lo + size - 1;
+    char *hi;
+    size_t usable_size;
 
     assert(size > 0);
 
+    usable_size = mm_malloc_usable_size(lo);
+    if (usable_size < size) {
+        malloc_error(trace, opnum,
+                     "Usable size (%zd) of payload %p is less than its size (%zd)",
+                     usable_size, lo, size);
+        return false;
+    }
+    hi = lo + usable_size - 1;
+
     /* Payload addresses must be ALIGNMENT-byte aligned */
     if (!IS_ALIGNED(lo)) {
         malloc_error(trace, opnum,
@@ -712,12 +771,16 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
         return false;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or of the
+       pages mapped by mm_map */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+         (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+        ((lo < (char *)mem_map_lo()) || (lo > (char *)mem_map_hi()) ||
+         (hi < (char *)mem_map_lo()) || (hi > (char *)mem_map_hi()))) {
         malloc_error(trace, opnum,
-                     "Payload (%p:%p) lies outside heap (%p:%p)",
-                     lo, hi, mem_heap_lo(), mem_heap_hi());
+                     "Payload (%p:%p) lies outside heap (%p:%p) and mappings (%p:%p)",
+                     lo, hi, mem_heap_lo(), mem_heap_hi(),
+                     mem_map_lo(), mem_map_hi());
         return false;
     }
 
@@ -934,6 +997,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     char type[MAXLINE];
     int index;
     size_t size;
+    size_t alignment;
     int max_index = 0;
     int op_index;
     int ignore = 0;
@@ -1007,6 +1071,19 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
                 trace->ops[op_index].type = FREE;
                 trace->ops[op_index].index = index;
                 break;
+            case 'm':
+                ignore += fscanf(tracefile, "%u %lu %lu", &index, &size, &alignment);
+                if (alignment == 0 || (alignment & (alignment - 1)) != 0 ||
+                    alignment % sizeof(void *) != 0) {
+                    app_error("Bad alignment (%lu) in tracefile %s\n",
+                              alignment, trace->filename);
+                }
+                trace->ops[op_index].type = MEMALIGN;
+                trace->ops[op_index].index = index;
+                trace->ops[op_index].size = size;
+                trace->ops[op_index].alignment = alignment;
+                max_index = (index > max_index) ? index : max_index;
+                break;
             default:
                 app_error("Bogus type character (%c) in tracefile %s\n",
                           type[0], trace->filename);
@@ -1065,6 +1142,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
     char *newp;
     char *oldp;
     char *p;
+    int num_frees = 0;
 
     /* Reset the heap and free any records in the range list */
     mem_reset_brk();
@@ -1126,6 +1204,28 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
                 randomize_block(trace, index);
                 break;
 
+            case MEMALIGN: /* mm_memalign */
+
+                /* Call the student's memalign */
+                if ((p = mm_memalign(trace->ops[i].alignment, size)) == NULL) {
+                    malloc_error(trace, i, "mm_memalign failed.");
+                    return false;
+                }
+                if (!IS_ALIGNED_TO(p, trace->ops[i].alignment)) {
+                    malloc_error(trace, i,
+                                 "Payload address (%p) not aligned to %zd bytes",
+                                 p, trace->ops[i].alignment);
+                    return false;
+                }
+
+                /* Same checks as a block from mm_malloc */
+                if (add_range(ranges, p, size, trace, i, index) == 0)
+                    return false;
+                trace->blocks[index] = p;
+                trace->block_sizes[index] = size;
+                randomize_block(trace, index);
+                break;
+
             case REALLOC: /* mm_realloc */
                 if (!check_index(trace, i, index, 0))
                     return false;
@@ -1173,14 +1273,18 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
                 if (!check_index(trace, i, index, 0))
                     return false;
 
-                /* Remove region from list and call student's free function */
+                /* Remove region from list and call student's free function,
+                 * every second block with the sized free */
                 if (index == -1) {
-                    p = 0;
+                    mm_free(0);
                 } else {
                     p = trace->blocks[index];
                     remove_range(ranges, p);
+                    if (num_frees++ % 2 == 0)
+                        mm_free(p);
+                    else
+                        mm_free_sized(p, trace->block_sizes[index]);
                 }
-                mm_free(p);
                 break;
 
             default:
@@ -1241,6 +1345,22 @@ static double eval_mm_util(trace_t *trace, int tracenum)
                 total_size += size;
                 break;
 
+            case MEMALIGN: /* mm_memalign */
+                index = trace->ops[i].index;
+                size = trace->ops[i].size;
+
+                if ((p = mm_memalign(trace->ops[i].alignment, size)) == NULL) {
+                    app_error("trace %d: mm_memalign failed in eval_mm_util",
+                              tracenum);
+                }
+
+                /* Remember region and size */
+                trace->blocks[index] = p;
+                trace->block_sizes[index] = size;
+
+                total_size += size;
+                break;
+
             case REALLOC: /* mm_realloc */
                 index = trace->ops[i].index;
                 newsize = trace->ops[i].size;
@@ -1282,7 +1402,8 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         /* update the high-water mark */
         max_total_size = (total_size > max_total_size) ?
             total_size : max_total_size;
-        heap_size = mem_heapsize();
+        /* Memory mapped by mm_map is part of the footprint too */
+        heap_size = mem_heapsize() + mem_mapsize();
         max_heap_size = (heap_size > max_heap_size) ?
             heap_size : max_heap_size;
     }
@@ -1324,6 +1445,14 @@ static void eval_mm_speed(void *ptr)
                 trace->blocks[index] = p;
                 break;
 
+            case MEMALIGN: /* mm_memalign */
+                index = trace->ops[i].index;
+                size = trace->ops[i].size;
+                if ((p = mm_memalign(trace->ops[i].alignment, size)) == NULL)
+                    app_error("mm_memalign error in eval_mm_speed");
+                trace->blocks[index] = p;
+                break;
+
             case REALLOC: /* mm_realloc */
                 index = trace->ops[i].index;
                 newsize = trace->ops[i].size;
@@ -1373,6 +1502,15 @@ static bool eval_libc_valid(trace_t *trace)
                 trace->blocks[trace->ops[i].index] = p;
                 break;
 
+            case MEMALIGN: /* posix_memalign */
+                if (posix_memalign((void **) &p, trace->ops[i].alignment,
+                                   trace->ops[i].size) != 0) {
+                    malloc_error(trace, i, "libc posix_memalign failed");
+                    unix_error("System message");
+                }
+                trace->blocks[trace->ops[i].index] = p;
+                break;
+
             case REALLOC: /* realloc */
                 newsize = trace->ops[i].size;
                 oldp = trace->blocks[trace->ops[i].index];
@@ -1424,6 +1562,14 @@ static void eval_libc_speed(void *ptr)
                 trace->blocks[index] = p;
                 break;
 
+            case MEMALIGN: /* posix_memalign */
+                index = trace->ops[i].index;
+                size = trace->ops[i].size;
+                if (posix_memalign((void **) &p, trace->ops[i].alignment, size) != 0)
+                    unix_error("posix_memalign failed in eval_libc_speed");
+                trace->blocks[index] = p;
+                break;
+
             case REALLOC: /* realloc */
                 index = trace->ops[i].index;
                 newsize = trace->ops[i].size;
@@ -1447,6 +1593,427 @@ static void eval_libc_speed(void *ptr)
     }
 }
 
+/*****************************************************************
+ * Multithreaded stress test (-S <threads>)
+ *
+ * Half of the threads are producers and half are consumers. Each
+ * producer mallocs blocks, fills them with a pattern and hands them
+ * to its consumer through a small queue; the consumer checks the
+ * pattern and frees the block, so almost every free is a free from
+ * another thread. Both sides also malloc and free some blocks of
+ * their own, a few of them with mm_memalign. The mm package must be
+ * built thread safe (e.g. make CC="gcc -DARENA_NUM=4").
+ ****************************************************************/
+
+#define STRESS_QUEUE_LEN 256     /* blocks in flight per producer/consumer pair */
+#define STRESS_OPS_PER_THREAD 200000
+#define STRESS_LOCAL_BLOCKS 64   /* blocks a thread keeps for itself */
+#define STRESS_MAX_ALIGN_SHIFT 13 /* mm_memalign blocks are aligned up to 64 KB */
+
+typedef struct {
+    char *block;
+    size_t size;
+    unsigned char pattern;
+} stress_item_t;
+
+/* One producer/consumer pair and the queue between them */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    stress_item_t items[STRESS_QUEUE_LEN];
+    int head;
+    int count;
+    int pair_id;
+    int errors;
+} stress_pair_t;
+
+/* Random block size, mostly small with a few large and very large ones */
+static size_t stress_size(unsigned int *seed)
+{
+    if (rand_r(seed) % 1024 == 0)
+        return 1 + rand_r(seed) % (512 * 1024);
+    if (rand_r(seed) % 16 == 0)
+        return 1 + rand_r(seed) % 16384;
+    return 1 + rand_r(seed) % 256;
+}
+
+/* Fill a new block, or check a block before it is freed; true if ok */
+static bool stress_pattern(char *block, size_t size, unsigned char pattern,
+                           bool check)
+{
+    size_t i;
+    if (!IS_ALIGNED(block))
+        return false;
+    for (i = 0; i < size; i++) {
+        if (!check)
+            block[i] = (char)(pattern + i);
+        else if (block[i] != (char)(pattern + i))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * stress_local - malloc or free one of the thread's own blocks, so the
+ *     thread's arena also sees same-thread traffic.
+ */
+static void stress_local(stress_pair_t *pair, stress_item_t *local,
+                         unsigned int *seed)
+{
+    stress_item_t *item = &local[rand_r(seed) % STRESS_LOCAL_BLOCKS];
+    if (item->block != NULL) {
+        if (!stress_pattern(item->block, item->size, item->pattern, true))
+            pair->errors++;
+        mm_free(item->block);
+        item->block = NULL;
+    } else {
+        size_t alignment = 0;
+        item->size = stress_size(seed);
+        item->pattern = (unsigned char)rand_r(seed);
+        if (rand_r(seed) % 8 == 0) {
+            alignment = (size_t)8 << (rand_r(seed) % (STRESS_MAX_ALIGN_SHIFT + 1));
+            item->block = mm_memalign(alignment, item->size);
+        } else {
+            item->block = mm_malloc(item->size);
+        }
+        if (item->block == NULL)
+            app_error("mm_malloc failed in stress test");
+        if (alignment != 0 && (!IS_ALIGNED_TO(item->block, alignment)
+                               || mm_malloc_usable_size(item->block) < item->size))
+            pair->errors++;
+        stress_pattern(item->block, item->size, item->pattern, false);
+    }
+}
+
+static void stress_local_free_all(stress_pair_t *pair, stress_item_t *local)
+{
+    int i;
+    for (i = 0; i < STRESS_LOCAL_BLOCKS; i++) {
+        if (local[i].block != NULL) {
+            if (!stress_pattern(local[i].block, local[i].size,
+                                local[i].pattern, true))
+                pair->errors++;
+            mm_free(local[i].block);
+        }
+    }
+}
+
+static void *stress_producer(void *arg)
+{
+    stress_pair_t *pair = (stress_pair_t *)arg;
+    stress_item_t local[STRESS_LOCAL_BLOCKS] = {{NULL, 0, 0}};
+    unsigned int seed = 2 * pair->pair_id + 1;
+    int i;
+
+    for (i = 0; i < STRESS_OPS_PER_THREAD; i++) {
+        stress_item_t item;
+        if (i % 4 == 3) {
+            stress_local(pair, local, &seed);
+            continue;
+        }
+        item.size = stress_size(&seed);
+        item.pattern = (unsigned char)rand_r(&seed);
+        if ((item.block = mm_malloc(item.size)) == NULL)
+            app_error("mm_malloc failed in stress test");
+        stress_pattern(item.block, item.size, item.pattern, false);
+
+        pthread_mutex_lock(&pair->lock);
+        while (pair->count == STRESS_QUEUE_LEN)
+            pthread_cond_wait(&pair->not_full, &pair->lock);
+        pair->items[(pair->head + pair->count) % STRESS_QUEUE_LEN] = item;
+        pair->count++;
+        pthread_cond_signal(&pair->not_empty);
+        pthread_mutex_unlock(&pair->lock);
+    }
+    stress_local_free_all(pair, local);
+    return NULL;
+}
+
+static void *stress_consumer(void *arg)
+{
+    stress_pair_t *pair = (stress_pair_t *)arg;
+    stress_item_t local[STRESS_LOCAL_BLOCKS] = {{NULL, 0, 0}};
+    unsigned int seed = 2 * pair->pair_id + 2;
+    int i;
+
+    /* The producer sends every op except each fourth one */
+    for (i = 0; i < STRESS_OPS_PER_THREAD; i++) {
+        stress_item_t item;
+        if (i % 4 == 3) {
+            stress_local(pair, local, &seed);
+            continue;
+        }
+        pthread_mutex_lock(&pair->lock);
+        while (pair->count == 0)
+            pthread_cond_wait(&pair->not_empty, &pair->lock);
+        item = pair->items[pair->head];
+        pair->head = (pair->head + 1) % STRESS_QUEUE_LEN;
+        pair->count--;
+        pthread_cond_signal(&pair->not_full);
+        pthread_mutex_unlock(&pair->lock);
+
+        if (!stress_pattern(item.block, item.size, item.pattern, true))
+            pair->errors++;
+        mm_free(item.block);
+    }
+    stress_local_free_all(pair, local);
+    return NULL;
+}
+
+/*
+ * run_stress_test - Run the producer/consumer stress test with
+ *     num_threads threads, return the number of corrupted blocks.
+ */
+static int run_stress_test(int num_threads)
+{
+    int num_pairs = num_threads < 2 ? 1 : num_threads / 2;
+    int i, stress_errors = 0;
+    stress_pair_t *pairs;
+    pthread_t *threads;
+    struct timespec start, end;
+    double secs;
+
+    pairs = (stress_pair_t *)calloc(num_pairs, sizeof(stress_pair_t));
+    threads = (pthread_t *)calloc(2 * num_pairs, sizeof(pthread_t));
+    if (pairs == NULL || threads == NULL)
+        unix_error("calloc in run_stress_test failed");
+
+    mem_init();
+    if (!mm_init())
+        app_error("mm_init failed in run_stress_test");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < num_pairs; i++) {
+        pthread_mutex_init(&pairs[i].lock, NULL);
+        pthread_cond_init(&pairs[i].not_empty, NULL);
+        pthread_cond_init(&pairs[i].not_full, NULL);
+        pairs[i].pair_id = i;
+        if (pthread_create(&threads[2 * i], NULL, stress_producer, &pairs[i]) != 0
+            || pthread_create(&threads[2 * i + 1], NULL, stress_consumer, &pairs[i]) != 0)
+            unix_error("pthread_create in run_stress_test failed");
+    }
+    for (i = 0; i < 2 * num_pairs; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for (i = 0; i < num_pairs; i++) {
+        stress_errors += pairs[i].errors;
+        pthread_mutex_destroy(&pairs[i].lock);
+        pthread_cond_destroy(&pairs[i].not_empty);
+        pthread_cond_destroy(&pairs[i].not_full);
+    }
+    if (!mm_checkheap(__LINE__))
+        stress_errors++;
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    printf("Stress test: %d producers, %d consumers, %d ops each\n",
+           num_pairs, num_pairs, STRESS_OPS_PER_THREAD);
+    printf("%.3f secs, %.0f Kops/sec, heap size %zu bytes, %d errors\n",
+           secs, 2.0 * num_pairs * STRESS_OPS_PER_THREAD / secs * 0.001,
+           mem_heapsize() + mem_mapsize(), stress_errors);
+
+    mem_deinit();
+    free(threads);
+    free(pairs);
+    return stress_errors;
+}
+
+/*****************************************************************
+ * Aligned allocation test (-A <rounds>)
+ *
+ * Keeps ALIGN_LIVE_BLOCKS blocks from mm_memalign, mm_posix_memalign
+ * and mm_aligned_alloc in turn, with the sizes of the stress test and
+ * alignments from 8 bytes to 64 KB. Every round frees and replaces
+ * about half of them. A new block is checked for its alignment and
+ * usable size and filled with a pattern, which is checked again
+ * before the block is freed, so a block that is too short or
+ * overlaps another one shows up as an error. Runs in every build.
+ ****************************************************************/
+
+#define ALIGN_LIVE_BLOCKS 64
+
+static void *align_alloc(int kind, size_t alignment, size_t size)
+{
+    void *p = NULL;
+    switch (kind) {
+    case 0:
+        return mm_memalign(alignment, size);
+    case 1:
+        if (mm_posix_memalign(&p, alignment, size) != 0)
+            return NULL;
+        return p;
+    default:
+        return mm_aligned_alloc(alignment, size);
+    }
+}
+
+static int run_align_test(int rounds)
+{
+    stress_item_t blocks[ALIGN_LIVE_BLOCKS] = {{NULL, 0, 0}};
+    unsigned int seed = 1;
+    int round, i, align_errors = 0;
+    void *p = NULL;
+
+    mem_init();
+    if (!mm_init())
+        app_error("mm_init failed in run_align_test");
+
+    /* Alignments that are not a power of 2 are refused */
+    if (mm_memalign(24, 100) != NULL || mm_posix_memalign(&p, 24, 100) != EINVAL
+        || mm_posix_memalign(&p, 4, 100) != EINVAL)
+        align_errors++;
+
+    for (round = 0; round < rounds; round++) {
+        for (i = 0; i < ALIGN_LIVE_BLOCKS; i++) {
+            stress_item_t *item = &blocks[i];
+            size_t alignment;
+            if (item->block != NULL) {
+                if (rand_r(&seed) % 2 == 0)
+                    continue;
+                if (!stress_pattern(item->block, item->size, item->pattern, true))
+                    align_errors++;
+                mm_free(item->block);
+            }
+            alignment = (size_t)8 << (rand_r(&seed) % (STRESS_MAX_ALIGN_SHIFT + 1));
+            item->size = stress_size(&seed);
+            item->pattern = (unsigned char)rand_r(&seed);
+            if ((item->block = align_alloc((round + i) % 3, alignment, item->size)) == NULL)
+                app_error("mm_memalign failed in aligned allocation test");
+            if (!IS_ALIGNED_TO(item->block, alignment)
+                || mm_malloc_usable_size(item->block) < item->size)
+                align_errors++;
+            stress_pattern(item->block, item->size, item->pattern, false);
+        }
+    }
+    for (i = 0; i < ALIGN_LIVE_BLOCKS; i++) {
+        if (blocks[i].block != NULL) {
+            if (!stress_pattern(blocks[i].block, blocks[i].size,
+                                blocks[i].pattern, true))
+                align_errors++;
+            mm_free(blocks[i].block);
+        }
+    }
+    if (!mm_checkheap(__LINE__))
+        align_errors++;
+
+    printf("Aligned allocation test: %d rounds of %d blocks\n",
+           rounds, ALIGN_LIVE_BLOCKS);
+    printf("heap size %zu bytes, %d errors\n",
+           mem_heapsize() + mem_mapsize(), align_errors);
+
+    mem_deinit();
+    return align_errors;
+}
+
+/*****************************************************************
+ * Batch test (-B <blocks>)
+ *
+ * Every round allocates a batch of blocks of one size, fills each
+ * block with its own byte, checks them all and frees them in a
+ * shuffled order. The rounds run once with loops of mm_malloc and
+ * mm_free and once with mm_malloc_batch and mm_free_batch, each on a
+ * new heap, and only the calls into the mm package are timed.
+ ****************************************************************/
+
+#define BATCH_ROUNDS 2000
+
+static const size_t batch_sizes[] = {16, 48, 100, 256, 1000, 4000};
+
+static double batch_elapsed(const struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+static int run_batch_test(int num_blocks)
+{
+    void **blocks, **order;
+    double secs[4];
+    unsigned int seed = 1;
+    struct timespec start;
+    size_t s, got;
+    int i, j, round, batch, batch_errors = 0;
+
+    blocks = (void **)calloc(num_blocks, sizeof(void *));
+    order = (void **)calloc(num_blocks, sizeof(void *));
+    if (blocks == NULL || order == NULL)
+        unix_error("calloc in run_batch_test failed");
+
+    mem_init();
+
+    printf("Batch test: %d blocks per batch, %d rounds (Kops/sec)\n",
+           num_blocks, BATCH_ROUNDS);
+    printf("%8s%10s%14s%10s%12s\n",
+           "size", "malloc", "malloc_batch", "free", "free_batch");
+    for (s = 0; s < sizeof(batch_sizes) / sizeof(batch_sizes[0]); s++) {
+        size_t size = batch_sizes[s];
+        memset(secs, 0, sizeof(secs));
+        for (batch = 0; batch < 2; batch++) {
+            mem_reset_brk();
+            if (!mm_init())
+                app_error("mm_init failed in run_batch_test");
+            for (round = 0; round < BATCH_ROUNDS; round++) {
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                if (batch) {
+                    got = mm_malloc_batch(size, num_blocks, blocks);
+                } else {
+                    for (got = 0; got < (size_t) num_blocks; got++)
+                        if ((blocks[got] = mm_malloc(size)) == NULL)
+                            break;
+                }
+                secs[2 * batch] += batch_elapsed(&start);
+                if (got != (size_t) num_blocks)
+                    app_error("%s failed in batch test",
+                              batch ? "mm_malloc_batch" : "mm_malloc");
+
+                for (i = 0; i < num_blocks; i++)
+                    memset(blocks[i], i & 0xff, size);
+                for (i = 0; i < num_blocks; i++) {
+                    unsigned char *p = (unsigned char *) blocks[i];
+                    if (!IS_ALIGNED(p) || mm_malloc_usable_size(p) < size)
+                        batch_errors++;
+                    else if (p[0] != (i & 0xff) || p[size - 1] != (i & 0xff))
+                        batch_errors++;
+                    order[i] = p;
+                }
+                /* Blocks that overlap would have lost their byte */
+
+                for (i = num_blocks - 1; i > 0; i--) {
+                    void *tmp;
+                    j = rand_r(&seed) % (i + 1);
+                    tmp = order[i];
+                    order[i] = order[j];
+                    order[j] = tmp;
+                }
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                if (batch) {
+                    mm_free_batch(order, num_blocks);
+                } else {
+                    for (i = 0; i < num_blocks; i++)
+                        mm_free(order[i]);
+                }
+                secs[2 * batch + 1] += batch_elapsed(&start);
+            }
+        }
+        printf("%8zu%10.0f%14.0f%10.0f%12.0f\n", size,
+               (double) num_blocks * BATCH_ROUNDS / secs[0] * 0.001,
+               (double) num_blocks * BATCH_ROUNDS / secs[2] * 0.001,
+               (double) num_blocks * BATCH_ROUNDS / secs[1] * 0.001,
+               (double) num_blocks * BATCH_ROUNDS / secs[3] * 0.001);
+    }
+    if (!mm_checkheap(__LINE__))
+        batch_errors++;
+    printf("heap size %zu bytes, %d errors\n",
+           mem_heapsize() + mem_mapsize(), batch_errors);
+
+    mem_deinit();
+    free(order);
+    free(blocks);
+    return batch_errors;
+}
+
 /*************************************
  * Some miscellaneous helper routines
  ************************************/
@@ -1841,4 +2408,9 @@ static void usage(char *prog)
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
+    fprintf(stderr, "\t-S <n>     Run the producer/consumer stress test with n threads\n");
+    fprintf(stderr, "\t           (needs a thread safe build, e.g. -DARENA_NUM=4)\n");
+    fprintf(stderr, "\t-B <n>     Time mm_malloc_batch/mm_free_batch of n blocks against\n");
+    fprintf(stderr, "\t           loops of mm_malloc/mm_free\n");
+    fprintf(stderr, "\t-A <n>     Run n rounds of the aligned allocation test\n");
 }
@@ -4,6 +4,7 @@
  * package with the system's malloc package in libc.
  *
  */
+#define _GNU_SOURCE /* mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -21,27 +22,54 @@
 /* private global variables */
 static unsigned char *heap;                 /* Starting address of heap */
 static unsigned char *mem_brk;              /* Current position of break */
+static unsigned char *mem_dirty_brk;        /* Old heap above the break may be dirty up to here */
 static unsigned char *mem_max_addr;         /* Maximum allowable heap address */
 
+/* Free page ranges of the mapping region, sorted by address */
+typedef struct map_range_t {
+    unsigned char *lo;
+    size_t size;
+    struct map_range_t *next;
+} map_range_t;
+
+static unsigned char *map_area;             /* Starting address of the mapping region */
+static unsigned char *map_brk;              /* End of the pages ever handed out */
+static unsigned char *map_max_addr;         /* Maximum allowable mapping address */
+static size_t map_bytes;                    /* Bytes currently mapped */
+static map_range_t *map_free_ranges;        /* Unmapped holes below map_brk */
+
 /* 
  * mm_sbrk - simple model of the sbrk function. Extends the heap 
  *           by incr bytes and returns the start address of the
- *           new area. In this model, the heap cannot be shrunk.
+ *           new area. A negative incr shrinks the heap, the whole
+ *           pages above the new break go back to the system and the
+ *           rest of its page is cleared, so the memory above the break
+ *           reads as zero when the heap grows over it again.
  */
 void *mm_sbrk(intptr_t incr) {
     unsigned char *old_brk = mem_brk;
 
     bool ok = true;
-    if (incr < 0) {
+    if (incr < 0 && mem_brk + incr < heap) {
 	ok = false;
-	fprintf(stderr, "ERROR: mm_sbrk failed.  Attempt to expand heap by negative value %ld\n", (long) incr);
-    } else if (mem_brk + incr > mem_max_addr) {
+	fprintf(stderr, "ERROR: mm_sbrk failed.  Attempt to shrink heap by %ld below its start\n", (long) -incr);
+    } else if (incr > 0 && mem_brk + incr > mem_max_addr) {
 	ok = false;
 	long alloc = mem_brk - heap + incr;
 	fprintf(stderr, "ERROR: mm_sbrk failed. Ran out of memory.  Would require heap size of %zd (0x%zx) bytes\n", alloc, alloc);
     }
     if (ok) {
 	mem_brk += incr;
+	if (incr < 0) {
+	    uintptr_t pagesize = mm_pagesize();
+	    uintptr_t lo = ((uintptr_t) mem_brk + pagesize - 1) & ~(pagesize - 1);
+	    uintptr_t hi = ((uintptr_t) old_brk + pagesize - 1) & ~(pagesize - 1);
+	    if (hi > lo)
+		madvise((void *) lo, hi - lo, MADV_DONTNEED);
+	    memset(mem_brk, 0, (lo < (uintptr_t) old_brk ? lo : (uintptr_t) old_brk) - (uintptr_t) mem_brk);
+	    if (old_brk >= mem_dirty_brk)
+		mem_dirty_brk = heap;
+	}
 	return (void *) old_brk;
     } else {
 	errno = ENOMEM;
@@ -49,6 +77,218 @@ void *mm_sbrk(intptr_t incr) {
     }
 }
 
+/*
+ * map_add_hole - put the unmapped range lo..lo+size back in the hole list,
+ *     in address order, merged with its neighbours
+ */
+static void map_add_hole(unsigned char *lo, size_t size) {
+    map_range_t **link;
+    map_range_t *prev = NULL;
+
+    for (link = &map_free_ranges; *link != NULL && (*link)->lo < lo; link = &(*link)->next)
+	prev = *link;
+    if (prev != NULL && prev->lo + prev->size == lo) {
+	prev->size += size;
+    } else {
+	map_range_t *range = malloc(sizeof(map_range_t));
+	if (range == NULL) {
+	    fprintf(stderr, "ERROR: map_add_hole failed.  No memory for the range list\n");
+	    exit(1);
+	}
+	range->lo = lo;
+	range->size = size;
+	range->next = *link;
+	*link = range;
+	prev = range;
+    }
+    if (prev->next != NULL && prev->lo + prev->size == prev->next->lo) {
+	map_range_t *next = prev->next;
+	prev->size += next->size;
+	prev->next = next->next;
+	free(next);
+    }
+    /* A hole at the end just lowers the break of the region */
+    if (prev->lo + prev->size == map_brk) {
+	map_range_t **last = &map_free_ranges;
+	while (*last != prev)
+	    last = &(*last)->next;
+	*last = NULL;
+	map_brk = prev->lo;
+	free(prev);
+    }
+}
+
+/*
+ * map_take - take size bytes of unmapped pages that start exactly at lo,
+ *     from a hole or from the break of the region; false if they are not free
+ */
+static bool map_take(unsigned char *lo, size_t size) {
+    map_range_t **link;
+
+    if (lo == map_brk) {
+	if (map_brk + size > map_max_addr)
+	    return false;
+	map_brk += size;
+	map_bytes += size;
+	return true;
+    }
+    for (link = &map_free_ranges; *link != NULL && (*link)->lo <= lo; link = &(*link)->next) {
+	map_range_t *range = *link;
+	if (range->lo == lo && range->size >= size) {
+	    range->lo += size;
+	    range->size -= size;
+	    if (range->size == 0) {
+		*link = range->next;
+		free(range);
+	    }
+	    map_bytes += size;
+	    return true;
+	}
+    }
+    return false;
+}
+
+/*
+ * mm_map - simple model of an anonymous mmap. Maps size bytes (rounded
+ *          up to whole pages) of zeroed, page-aligned memory in a region
+ *          separate from the heap, and returns its start address.
+ */
+void *mm_map(size_t size) {
+    size_t pagesize = mm_pagesize();
+    map_range_t **link;
+    unsigned char *addr;
+
+    if (size == 0) {
+	errno = EINVAL;
+	return (void *) -1;
+    }
+    size = (size + pagesize - 1) & ~(pagesize - 1);
+
+    /* First fit in the holes left by mm_unmap */
+    for (link = &map_free_ranges; *link != NULL; link = &(*link)->next) {
+	map_range_t *range = *link;
+	if (range->size >= size) {
+	    addr = range->lo;
+	    range->lo += size;
+	    range->size -= size;
+	    if (range->size == 0) {
+		*link = range->next;
+		free(range);
+	    }
+	    map_bytes += size;
+	    return (void *) addr;
+	}
+    }
+
+    if (map_brk + size > map_max_addr) {
+	fprintf(stderr, "ERROR: mm_map failed. Ran out of memory.  Would require mapping of %zd (0x%zx) bytes\n", size, size);
+	errno = ENOMEM;
+	return (void *) -1;
+    }
+    addr = map_brk;
+    map_brk += size;
+    map_bytes += size;
+    return (void *) addr;
+}
+
+/*
+ * mm_unmap - simple model of munmap. Gives the pages of a mapping made
+ *            by mm_map back to the system right away (they read as zero
+ *            when mapped again).
+ */
+int mm_unmap(void *addr, size_t size) {
+    size_t pagesize = mm_pagesize();
+    unsigned char *lo = (unsigned char *) addr;
+
+    size = (size + pagesize - 1) & ~(pagesize - 1);
+    if (size == 0 || ((uintptr_t) lo & (pagesize - 1)) != 0 ||
+	lo < map_area || lo + size > map_brk) {
+	fprintf(stderr, "ERROR: mm_unmap failed.  Invalid mapping %p (%zd bytes)\n", addr, size);
+	errno = EINVAL;
+	return -1;
+    }
+    madvise(lo, size, MADV_DONTNEED);
+    map_bytes -= size;
+    map_add_hole(lo, size);
+    return 0;
+}
+
+/*
+ * mm_purge - simple model of madvise(MADV_DONTNEED) on the heap. Gives
+ *            the whole pages inside addr..addr+size back to the system,
+ *            the heap does not shrink and the pages read as zero when
+ *            touched again. The bytes around them are not changed.
+ */
+int mm_purge(void *addr, size_t size) {
+    uintptr_t pagesize = mm_pagesize();
+    uintptr_t lo = ((uintptr_t) addr + pagesize - 1) & ~(pagesize - 1);
+    uintptr_t hi = ((uintptr_t) addr + size) & ~(pagesize - 1);
+
+    if ((unsigned char *) addr < heap || (unsigned char *) addr + size > mem_brk) {
+	fprintf(stderr, "ERROR: mm_purge failed.  Range %p (%zd bytes) is not in the heap\n", addr, size);
+	errno = EINVAL;
+	return -1;
+    }
+    if (hi > lo)
+	madvise((void *) lo, hi - lo, MADV_DONTNEED);
+    return 0;
+}
+
+/*
+ * mm_remap - simple model of mremap with MREMAP_MAYMOVE. Resizes a
+ *            mapping made by mm_map and returns its (maybe new) address.
+ *            It shrinks or grows in place when the pages after it are
+ *            unmapped; otherwise the kernel moves the old pages to a new
+ *            place by their page tables, no byte is copied.
+ */
+void *mm_remap(void *addr, size_t old_size, size_t new_size) {
+    size_t pagesize = mm_pagesize();
+    unsigned char *lo = (unsigned char *) addr;
+    unsigned char *new_lo;
+
+    old_size = (old_size + pagesize - 1) & ~(pagesize - 1);
+    new_size = (new_size + pagesize - 1) & ~(pagesize - 1);
+    if (old_size == 0 || new_size == 0 || ((uintptr_t) lo & (pagesize - 1)) != 0 ||
+	lo < map_area || lo + old_size > map_brk) {
+	fprintf(stderr, "ERROR: mm_remap failed.  Invalid mapping %p (%zd bytes)\n", addr, old_size);
+	errno = EINVAL;
+	return (void *) -1;
+    }
+    if (new_size <= old_size) {
+	if (new_size < old_size)
+	    mm_unmap(lo + new_size, old_size - new_size);
+	return addr;
+    }
+    if (map_take(lo + old_size, new_size - old_size))
+	return addr;
+
+    new_lo = mm_map(new_size);
+    if (new_lo == (void *) -1)
+	return (void *) -1;
+    if (mremap(lo, old_size, old_size, MREMAP_MAYMOVE | MREMAP_FIXED, new_lo) == MAP_FAILED) {
+	mm_unmap(new_lo, new_size);
+	return (void *) -1;
+    }
+    /* The old pages left a gap in the region, fill it with fresh pages */
+    if (mmap(lo, old_size, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+	fprintf(stderr, "FAILURE.  mmap couldn't fill the mapping region after mm_remap\n");
+	exit(1);
+    }
+    map_bytes -= old_size;
+    map_add_hole(lo, old_size);
+    return new_lo;
+}
+
+/*
+ * mm_zero_lo - return the address from which the heap that mm_sbrk
+ *     hands out reads as zero. It is the break, unless mem_reset_brk
+ *     left an old heap above it.
+ */
+void *mm_zero_lo(){
+    return (void *)(mem_brk > mem_dirty_brk ? mem_brk : mem_dirty_brk);
+}
+
 /*
  * mm_heap_lo - return address of the first heap byte
  */
@@ -137,7 +377,20 @@ void mem_init(){
 	exit(1);
     }
     heap = addr;
+    mem_brk = addr;
+    mem_dirty_brk = addr;
     mem_max_addr = addr + MAX_HEAP_SIZE;
+
+    addr = mmap(NULL, MAX_HEAP_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED) {
+	fprintf(stderr, "FAILURE.  mmap couldn't allocate space for mappings\n");
+	exit(1);
+    }
+    map_area = addr;
+    map_brk = addr;
+    map_max_addr = addr + MAX_HEAP_SIZE;
+    map_free_ranges = NULL;
     mem_reset_brk();
 }
 
@@ -149,13 +402,37 @@ void mem_deinit(void){
         fprintf(stderr, "FAILURE.  munmap couldn't deallocate heap space\n");
         exit(1);
     }
+    mem_reset_map();
+    if (munmap(map_area, MAX_HEAP_SIZE) != 0) {
+        fprintf(stderr, "FAILURE.  munmap couldn't deallocate mapping space\n");
+        exit(1);
+    }
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *     the old heap is not cleared (see mm_zero_lo)
  */
 void mem_reset_brk(){
+    if (mem_brk > mem_dirty_brk)
+	mem_dirty_brk = mem_brk;
     mem_brk = heap;
+    mem_reset_map();
+}
+
+/*
+ * mem_reset_map - unmap everything mm_map handed out
+ */
+void mem_reset_map(){
+    while (map_free_ranges != NULL) {
+	map_range_t *next = map_free_ranges->next;
+	free(map_free_ranges);
+	map_free_ranges = next;
+    }
+    if (map_brk > map_area)
+	madvise(map_area, map_brk - map_area, MADV_DONTNEED);
+    map_brk = map_area;
+    map_bytes = 0;
 }
 
 void *mem_sbrk(intptr_t incr) {
@@ -174,6 +451,19 @@ size_t mem_heapsize() {
     return (size_t)(mem_brk - heap);
 }
 
+void *mem_map_lo(){
+    return (void *) map_area;
+}
+
+void *mem_map_hi(){
+    return (void *)(map_brk - 1);
+}
+
+/* Bytes mapped by mm_map right now, they count in the heap size for utilization */
+size_t mem_mapsize() {
+    return map_bytes;
+}
+
 size_t mem_pagesize(){
     return (size_t) getpagesize();
 }
@@ -7,8 +7,13 @@
 void *mm_sbrk(intptr_t incr);
 void *mm_heap_lo(void);
 void *mm_heap_hi(void);
+void *mm_zero_lo(void);
 size_t mm_heapsize(void);
 size_t mm_pagesize(void);
+void *mm_map(size_t size);
+int mm_unmap(void *addr, size_t size);
+int mm_purge(void *addr, size_t size);
+void *mm_remap(void *addr, size_t old_size, size_t new_size);
 void *mm_memcpy(void *dst, const void *src, size_t n);
 void *mm_memset(void *dst, int c, size_t n);
 
@@ -19,9 +24,13 @@ void mem_init();
 void mem_deinit(void);
 void *mem_sbrk(intptr_t incr);
 void mem_reset_brk(void); 
+void mem_reset_map(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+void *mem_map_lo(void);
+void *mem_map_hi(void);
+size_t mem_mapsize(void);
 size_t mem_pagesize(void);
 
 /* Read len bytes and return value zero-extended to 64 bits */
@@ -12,20 +12,66 @@
  * [8bytes header + real payload data block (Min_payload size is 16) + 8 bytes footer]
  * The header contains size in first 7 bytes and last bytes is marker of free / allocated.
  * After the init: 8bytes padding + (header ----8bytes---- footer ----8bytes----) + [every new block] + (epilogue ----8bytes----)
- * 
+ *
+ * FOOTERLESS mode (default on, -DFOOTERLESS=0 to turn off):
+ * The allocated block will only have [8bytes header + payload], the footer is only needed when the block is free.
+ * Bit 1 of the header records if the previous block is allocated, so merge() only reads the previous footer
+ * when that bit says the previous block is free. Every malloc/free updates the next block's bit 1 (the epilogue too).
+ * This saves 8 bytes per allocated block and a footer write on every malloc.
+ * FOOTERLESS mode also has a 16 bytes mini block for requests of 8 bytes or less: [8bytes header + 8bytes payload].
+ * A free mini block only has room for 8 bytes, so they live in their own mini_freelist_head beside freelist_heads[]
+ * with 32 bits prev/next offsets (like -DCOMPRESSED_LINKS=1), the list is doubly linked and merge() removes a mini
+ * block without walking the list. Bit 2 of the header tells merge() the previous block is a mini block.
+ * split_and_allocate_block keeps a 16 bytes leftover as a free mini block instead of giving it away.
+ *
+ * TLSF engine (-DTLSF=1):
+ * add_to_freelist / remove_from_freelist / find_firstfit_in_free_list can use a two level segregated fit instead
+ * of the 10 lists. First level is the power of 2 range, second level is 8 linear pieces of it, and two bitmaps
+ * tell which lists are not empty. The search rounds the size up to the next piece, so the head of the first
+ * non-empty list found by find-first-set always fits. Its control block sits at the beginning of the heap.
+ *
+ * Slab engine (-DSLAB=1):
+ * malloc of 256 bytes or less takes a slot from a run, a run is a 4096 bytes aligned page (one allocated heap block)
+ * cut into slots of one size with a small header and a bitmap of free slots. Slots have no header, so free() and
+ * realloc() first ask the run map (one bit per heap page) if the pointer is in a run. An empty run goes back to the heap.
+ * It is much faster for small blocks, but a run per size class costs a lot of utilization on traces with few live blocks.
+ *
+ * Arenas:
+ * All the heap state (free lists, bitmaps, control blocks, prelogue and epilogue) is in an arena_t at the beginning of
+ * heap, and the functions work on the arena of the current thread. With -DARENA_NUM=N each thread binds to one of N
+ * arenas with its own lock; an arena that is not at the end of heap grows by a new chunk with its own prelogue and
+ * epilogue. free() reads the arena index from the header, so it always goes back to the arena that owns the block.
+ * A thread never takes the lock of another thread's arena to free, it pushes the block to that arena's remote free
+ * stack with one compare and swap, and the owner merges the whole stack when its malloc misses the quick lists.
+ * In front of the arenas every thread has a tcache: freed blocks up to 512 bytes wait in the thread's bin of their size
+ * and the next malloc of that size takes them back with no lock. Full bins and exiting threads give them back.
+ * With -DPERCPU_CACHE=1 the same bins are per CPU instead, pushed and popped by rseq restartable sequences,
+ * so the cached memory grows with the number of CPUs and not with the number of threads.
+ *
  * malloc Design:
  * There are serval helper functions that can obtain the size of the block, the pointer to payload, pointer to next block and block checker for allocated or not etc.
  * Malloc Logic Brief:
  * Once the malloc called, it will check the valid and alignment of the size that user asking. 
  * Then it will use the aligned size (including the header and footer size) to find the free block in free list by find_firstfit_in_free_list function.
+ * freelist_bitmap keeps one bit per non-empty list, so the search jumps to the first usable list with ctz.
+ * The search is a bounded good fit: it keeps the tightest of the first FIT_SEARCH_LIMIT blocks that fit,
+ * and stops early on a block within FIT_SLACK bytes of the size (both can be set at build time).
+ * The last range (> 16384 bytes) is not a list but an AVL tree keyed by (size, address) and stored inside the
+ * free blocks, so large best fit is O(log n) and the lowest address block of the best size is reused first.
  * If found, the find_firstfit_in_free_list function will return the ptr that points to the free block's payload.
  *           then remove the select free block from the free list first, then split_and_allocate_block will split, allocate 
  *           and put extra free block back to free list, if the left extra is larger or equal to minimum block size.
  * If not found, the find_firstfit_in_free_list function will return NULL,
  *           then it will use the mm_sbrk in expand_heap to expand new space for the block.
+ *           If the last block before the epilogue is free, expand_heap takes it and only asks for the missing bytes.
  *           and also use split_and_allocate_block function to allocate the block.
+ * A request of MMAP_THRESHOLD bytes or more skips all of this and gets its own pages from mm_map (bit 3 of its header),
+ * free() gives them back with mm_unmap, so large blocks never leave holes in the heap.
  * 
  * free Design:
+ * A block of 256 bytes or less does not merge, it stays allocated and waits in the quick list of its size,
+ * the next malloc of this size pops it. A quick list longer than QUICK_LIST_LIMIT, or a malloc that
+ * finds no free block, sends the waiting blocks through the normal free path below.
  * The free function will firstly mark the curr_block's header and footer to free (0),
  * then use the merge() function to merge the prev or next block that is also free,
  * If there is no other free block nearby,
@@ -34,10 +80,17 @@
  *           the merge will remove the nearby free block from the free list first
  *           then it will merge them to one big free block
  *           then it will add the bigger free block back to free list again.
+ * If the merged block is the last one in heap and at least 2 * TRIM_THRESHOLD bytes, the epilogue moves down
+ *           and mm_sbrk gets a negative increment, so the heap gives back all but a pad of the memory.
+ * Every DECAY_FREES frees, the large free blocks that stayed free for a whole epoch get their inner pages
+ *           purged with mm_purge, the block keeps its tags and is marked with zero_pages_bit.
  * 
  * realloc Design:
  * The realloc function will check parameters size and ptr first, 
- * then it will get the minimum number among size and the block pointed by oldptr.
+ * If the new size still fits in the block, it shrinks in place, and the tail goes back to free list (merged with next free block).
+ * If the next block is free and the two blocks together are large enough, it takes the next block in place and splits off the extra.
+ * If the block is the last one before the epilogue, it calls mm_sbrk for only the missing bytes and moves the epilogue.
+ * Only when both fail, it gets the minimum number among size and the block pointed by oldptr.
  * then just use malloc() we inplemented, to arrange a new sapce for it, old space will be free.
  * malloc will do the find first fit or expand new space in heap.
  * 
@@ -56,6 +109,14 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <errno.h>
+#if defined(__linux__) && defined(__x86_64__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#endif
+#endif
 
 #include "mm.h"
 #include "memlib.h"
@@ -77,6 +138,151 @@
 #define dbg_assert(...)
 #endif // DEBUG
 
+/*
+ * FOOTERLESS mode: allocated blocks drop their footer and the header keeps
+ * the allocated status of the previous block in bit 1 instead.
+ * Free blocks still have the footer, merge() only reads it when bit 1 says
+ * the previous block is free. Build with -DFOOTERLESS=0 to get back the
+ * classic header + footer on every block.
+ */
+#ifndef FOOTERLESS
+#define FOOTERLESS 1
+#endif
+
+/*
+ * TLSF engine: build with -DTLSF=1 to replace the 10 segregated free lists with
+ * a two level segregated fit (first level power of 2, second level linear),
+ * so finding a free block is 2 find-first-set on the bitmaps instead of walking lists.
+ * The default 0 keeps the segregated free list, so both can be compared on mdriver.
+ */
+#ifndef TLSF
+#define TLSF 0
+#endif
+
+/*
+ * Good fit policy of the segregated free list: look at up to FIT_SEARCH_LIMIT
+ * blocks that fit and take the tightest one, stop right away when a block is
+ * within FIT_SLACK bytes of the asked size. FIT_SEARCH_LIMIT=1 is first fit.
+ */
+#ifndef FIT_SEARCH_LIMIT
+#define FIT_SEARCH_LIMIT 8
+#endif
+#ifndef FIT_SLACK
+#define FIT_SLACK 0
+#endif
+
+/*
+ * expand_heap asks mm_sbrk for at least MIN_HEAP_GROW bytes (multiple of 16),
+ * so a burst of small misses costs one sbrk, the extra part stays as a free block.
+ */
+#ifndef MIN_HEAP_GROW
+#define MIN_HEAP_GROW 0
+#endif
+
+/*
+ * Requests of MMAP_THRESHOLD bytes or more do not go in the heap, each one gets its own pages from mm_map,
+ * and free() gives them back at once with mm_unmap, so a big block never leaves a hole in the heap.
+ * MMAP_THRESHOLD=0 keeps every block in the heap.
+ */
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (128 * 1024)
+#endif
+
+/*
+ * When free() leaves a free block of 2 * TRIM_THRESHOLD bytes or more just before the epilogue at the end of heap,
+ * the epilogue moves down and mm_sbrk lowers the break, so a heap that grew in a burst shrinks again.
+ * A pad of TRIM_THRESHOLD bytes stays free at the top, and it grows to the whole top block once the heap grows back
+ * after a trim, so freeing and mallocing the top of heap in a loop does not shrink and grow it every time.
+ * TRIM_THRESHOLD=0 never trims.
+ */
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD (128 * 1024)
+#endif
+
+/*
+ * Decay purge: every DECAY_FREES blocks freed in an arena start a new epoch, and a block in the large tree
+ * that has been free since before the last epoch gets the whole pages inside it purged with mm_purge,
+ * so the memory of a burst does not stay with the process while the heap can not shrink.
+ * The header, tree node and footer are kept, so the block is still a normal free block,
+ * and zero_pages_bit in its header tells a later calloc that those pages read as zero.
+ * DECAY_FREES=0 never purges, TLSF has no large tree so it never purges either.
+ */
+#ifndef DECAY_FREES
+#define DECAY_FREES 4096
+#endif
+
+/*
+ * Quick lists: free() of a small block (up to quick_max_block_size) does not merge,
+ * the block stays marked allocated and goes to a LIFO list of its exact size, so the
+ * next malloc of that size just pops it. A list with more than QUICK_LIST_LIMIT blocks,
+ * or a malloc that finds nothing, flushes the blocks back through merge().
+ * QUICK_LIST_LIMIT=0 turns them off.
+ */
+#ifndef QUICK_LIST_LIMIT
+#define QUICK_LIST_LIMIT 32
+#endif
+
+/*
+ * Slab engine: build with -DSLAB=1 to serve requests up to 256 bytes from page sized
+ * runs of same size slots. A slot has no header, a bitmap in the run says which slots
+ * are free, and free() finds the run from a page map, so small blocks never split or merge.
+ */
+#ifndef SLAB
+#define SLAB 0
+#endif
+
+/*
+ * Compressed links: build with -DCOMPRESSED_LINKS=1 to store the free list prev/next as 32 bits
+ * offsets (in 16 bytes) from the heap start instead of 64 bits pointers, node_t is 8 bytes then
+ * (the mini free list always uses these links).
+ * The heap can not be larger than 2^32 * 16 bytes = 64GB in this mode.
+ */
+#ifndef COMPRESSED_LINKS
+#define COMPRESSED_LINKS 0
+#endif
+
+/*
+ * Arenas: build with -DARENA_NUM=N (N > 1) to make malloc/free/realloc thread safe.
+ * Each thread binds to one of N arenas (round robin), every arena has its own free lists,
+ * quick lists and its own chunks of heap, and its own lock, so threads on different arenas
+ * never wait for each other. Allocated headers keep the arena index in bits 48-55, so a free
+ * from another thread goes back to the owning arena: it is pushed to the arena's lock free remote free
+ * stack, and the owner frees them all in its next malloc slow path. Only mm_sbrk is behind one global lock.
+ * The default 0 is the single threaded allocator with no locking at all.
+ */
+#ifndef ARENA_NUM
+#define ARENA_NUM 0
+#endif
+#if ARENA_NUM > 1 && SLAB
+#error "Slab slots have no header to tell their arena, SLAB needs ARENA_NUM 0"
+#endif
+
+/*
+ * Thread cache: every thread keeps up to TCACHE_COUNT freed blocks of each small size (up to 512 bytes)
+ * and malloc/free of those sizes do not take any lock or touch any boundary tag. A full bin goes back
+ * to the arenas at once, and a thread's cache is given back when the thread exits.
+ * It is on by default only with arenas, without locks the quick lists already do the same work.
+ * Slab slots have no header to tell their size, so SLAB turns it off.
+ */
+#ifndef TCACHE_COUNT
+#define TCACHE_COUNT (ARENA_NUM > 1 ? 16 : 0)
+#endif
+
+/*
+ * Per-CPU cache: build with -DPERCPU_CACHE=1 (and ARENA_NUM > 1) to cache the small blocks per CPU instead of
+ * per thread, so hundreds of idle threads do not each keep a cache full of blocks. Push and pop are Linux
+ * restartable sequences (rseq registered by glibc 2.35 or later), only x86-64 is written. Without rseq, at
+ * build time or at run time, the thread cache above is used.
+ */
+#ifndef PERCPU_CACHE
+#define PERCPU_CACHE 0
+#endif
+#if PERCPU_CACHE && ARENA_NUM > 1 && defined(RSEQ_SIG)
+#define percpu_enabled 1
+#else
+#define percpu_enabled 0
+#endif
+
 // do not change the following!
 #ifdef DRIVER
 // create aliases for driver tests
@@ -84,6 +290,13 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define aligned_alloc mm_aligned_alloc
+#define posix_memalign mm_posix_memalign
+#define free_sized mm_free_sized
+#define malloc_usable_size mm_malloc_usable_size
+#define malloc_batch mm_malloc_batch
+#define free_batch mm_free_batch
 #define memset mm_memset
 #define memcpy mm_memcpy
 #endif // DRIVER
@@ -96,101 +309,562 @@ static size_t align(size_t x)
     return ALIGNMENT * ((x+ALIGNMENT-1)/ALIGNMENT);
 }
 
-//here are heap pointer to the beginning of heap, prelogure and epilogue blocks
-//All the information are stored in the header and footer of block
-uint64_t* heap_pre_before_padding;
-uint64_t* heap_pre;
-uint64_t* heap_epi;
-
 //Define the header and footer size, also define the number of freelist in the freelist_array
 #define header_size 8 //header and footer are always 8 bytes.
 #define footer_size 8
 #define free_list_num 10
-
+#define freelist_first_log2 6 //Free list 0 holds blocks up to 64 bytes, each next list doubles it, the last list holds the rest.
+
+//Low bits of the header, block size is always multiple of 16 so the last 4 bits are free to use.
+//bit 0: this block is allocated.
+//bit 1: previous block is allocated (only maintained in FOOTERLESS mode).
+//bit 2: previous block is a 16 bytes mini block (only maintained in FOOTERLESS mode).
+//bit 3: the block is a mapping of its own from mm_map, not in the heap.
+//       On a free block in heap it is zero_pages_bit instead: the pages inside the block read as zero,
+//       they were purged or just came from mm_sbrk (see get_zero_pages_range).
+#define alloc_bit 0x1
+#define prev_alloc_bit 0x2
+#define prev_mini_bit 0x4
+#define mapped_bit 0x8
+#define zero_pages_bit 0x8
+
+//Allocated block overhead, and the minimum block size.
+//A normal free block needs header + prev* + next* + footer = 32 bytes.
+//In FOOTERLESS mode there is also the 16 bytes mini block: header + 8 bytes payload when allocated,
+//header + 32 bits prev/next links when free, it has no footer so the next block uses prev_mini_bit to find it.
+#if FOOTERLESS
+#define alloc_overhead header_size
+#define min_block_size 16
+#else
+#define alloc_overhead (header_size + footer_size)
+#define min_block_size 32
+#endif
+#define mini_block_size 16
+#define min_normal_block_size 32
+
+
+//A free list link, it is the pointer itself, or in COMPRESSED_LINKS mode the offset from the
+//prelogue payload in 16 bytes (0 is NULL, the prelogue is never free).
+#define compressed_heap_max_size ((uint64_t)1 << 36) //2^32 links of 16 bytes.
+#if COMPRESSED_LINKS
+typedef uint32_t link_t;
+#else
+typedef struct node_t* link_t;
+#endif
 
 //Here is the explicit free list struct, it provides prev* and next*.
 //the prev and next ptr point to the previous and next free block in the heap
+//Always use the get/set functions below, so it works with both kinds of link.
 typedef struct node_t
 {   
-    struct node_t* prev;
-    struct node_t* next;
+    link_t prev;
+    link_t next;
 }node_t;
 
-//Init the freelist_heads, since the freelist is doubly linked list,
-//it can be init by set the head to NULL
-node_t* freelist_heads[free_list_num];
+//Singly linked node in the payload of an allocated block, for the quick lists, caches and remote free stacks.
+typedef struct mini_node_t
+{
+    struct mini_node_t* next;
+}mini_node_t;
+
+//Free mini block only has space for 8 bytes, so its links are always 32 bits offsets (the same as compressed links).
+//A mini block 64GB or more after the prelogue of its arena can not be linked, it stays free outside the list
+//and only comes back by merge().
+typedef struct mini_free_node_t
+{
+    uint32_t prev;
+    uint32_t next;
+}mini_free_node_t;
+
+//Arena, everything a heap needs. Arena 0 is made by mm_init, the others when a thread first binds to them.
+//The struct is too large for the global variables, so it is at the beginning of heap like the TLSF control block.
+//An arena gets more heap by moving its epilogue when it is at the end of heap, otherwise (another arena grew
+//after it) it starts a new chunk: 8 bytes link to the next chunk's prelogue + prelogue + blocks + epilogue.
+typedef struct arena_t
+{
+    //Init the freelist_heads, since the freelist is doubly linked list,
+    //it can be init by set the head to NULL
+    node_t* freelist_heads[free_list_num];
+    mini_free_node_t* mini_freelist_head;
+    //Bit i is 1 when freelist_heads[i] is not empty, so the search can jump to the first usable list with one ctz.
+    uint64_t freelist_bitmap;
+    struct tlsf_control_t* tlsf_control;
+    struct small_control_t* small_control;
+    //here are heap pointer to the prelogue of first chunk and the epilogue of the last chunk
+    //All the information are stored in the header and footer of block
+    uint64_t* heap_pre;
+    uint64_t* heap_epi;
+    uint64_t* last_chunk_pre;
+    uint64_t header_bits;    //Arena index at bit 48, put_header adds it to every header.
+    pthread_mutex_t lock;
+    //Blocks of this arena freed by threads of other arenas, a lock free stack that any thread can push to
+    //and only the owner (with the lock) takes all at once, so it needs no ABA tag. The blocks are still allocated.
+    mini_node_t* remote_free_head;
+    uint64_t decay_epoch;     //Count of DECAY_FREES frees so far.
+    uint64_t decay_free_count;    //Frees since the last epoch started.
+    uint64_t trim_pad;    //Free bytes trim_heap keeps at the end of heap, 0 before the first trim.
+    uint64_t regrow_size;    //Bytes expand_heap asked from mm_sbrk since the last trim.
+}arena_t;
+
+#define arena_index_shift 48
+#define arena_index_mask 0xFF
+#define arena_chunk_size (64 * 1024) //A new chunk is at least this large, so arenas do not interleave every sbrk.
+#define arena_max_num (ARENA_NUM > 1 ? ARENA_NUM : 1)
+
+__thread arena_t* arena;    //The arena this thread works on, its own one except inside a free() from another thread.
+arena_t** arena_table;
+uint32_t arena_bind_count;    //Next thread binds to arena_bind_count % arena_max_num.
+pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;    //mm_sbrk and arena_bind_count.
+
+//Thread cache, bin i keeps allocated blocks of size (i + 1) * 16 freed by this thread, linked by the payload.
+//The cache itself is a normal block from the thread's arena, a pthread key gives it back when the thread exits.
+#define tcache_enabled (TCACHE_COUNT > 0 && !SLAB)
+#define tcache_bin_num 32
+#define tcache_max_block_size (tcache_bin_num * 16)
+
+typedef struct tcache_t
+{
+    mini_node_t* heads[tcache_bin_num];
+    uint32_t counts[tcache_bin_num];
+}tcache_t;
+
+__thread tcache_t* tcache;
+pthread_key_t tcache_key;
+pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+//Per-CPU cache, the same bins as the thread cache, but each bin is an array and its top is the commit store of the
+//restartable sequence. A CPU's cache is made by mm_sbrk when the CPU is first seen, percpu_table is at the beginning of heap.
+#define percpu_bin_slots 8
+
+typedef struct percpu_bin_t
+{
+    uint64_t top;
+    void* slots[percpu_bin_slots];
+}percpu_bin_t;
+
+typedef struct percpu_cache_t
+{
+    percpu_bin_t bins[tcache_bin_num];
+}percpu_cache_t;
+
+percpu_cache_t** percpu_table;
+uint32_t percpu_cpu_num;
+
+
+node_t* link_to_node(link_t link){
+#if COMPRESSED_LINKS
+    if (link == 0){
+        return NULL;
+    }
+    return (node_t*)((char*)arena->heap_pre + header_size + ((uint64_t)link << 4));
+#else
+    return link;
+#endif
+}
+
+link_t node_to_link(node_t* node){
+#if COMPRESSED_LINKS
+    if (node == NULL){
+        return 0;
+    }
+    return (link_t)(((char*)node - (char*)arena->heap_pre - header_size) >> 4);
+#else
+    return node;
+#endif
+}
+
+node_t* get_prev_node(node_t* node){
+    return link_to_node(node->prev);
+}
+
+node_t* get_next_node(node_t* node){
+    return link_to_node(node->next);
+}
+
+void set_prev_node(node_t* node, node_t* prev){
+    node->prev = node_to_link(prev);
+}
+
+void set_next_node(node_t* node, node_t* next){
+    node->next = node_to_link(next);
+}
+
+//Mini free list links, offsets from the prelogue payload in 16 bytes like link_to_node in COMPRESSED_LINKS mode.
+mini_free_node_t* mini_link_to_node(uint32_t link){
+    if (link == 0){
+        return NULL;
+    }
+    return (mini_free_node_t*)((char*)arena->heap_pre + header_size + ((uint64_t)link << 4));
+}
+
+uint32_t mini_node_to_link(mini_free_node_t* node){
+    if (node == NULL){
+        return 0;
+    }
+    return (uint32_t)(((char*)node - (char*)arena->heap_pre - header_size) >> 4);
+}
+
+bool is_mini_node_linkable(void* node){
+    return (uint64_t)((char*)node - (char*)arena->heap_pre - header_size) < compressed_heap_max_size;
+}
 
 void free_list_array_init(){
     for(int i = 0; i < free_list_num; i++){
-        freelist_heads[i] = NULL;
+        arena->freelist_heads[i] = NULL;
     }
+    arena->mini_freelist_head = NULL;
+    arena->freelist_bitmap = 0;
     //This function will be call when mm_init to init the freelist array with heap at the same time.
 }
 
+
+//TLSF engine.
+//First level index is the power of 2 range of the block size, second level splits this range to tlsf_sl_count linear pieces.
+//Block smaller than tlsf_small_block_size all go to first level 0, the second level there is just size / 16.
+//fl_bitmap bit i says sl_bitmap[i] is not 0, and sl_bitmap[i] bit j says heads[i][j] is not empty.
+//The control block is too large for the global variables, so mm_init puts it at the beginning of heap.
+#define tlsf_sl_log2 3
+#define tlsf_sl_count (1 << tlsf_sl_log2)
+#define tlsf_align_log2 4
+#define tlsf_fl_shift (tlsf_sl_log2 + tlsf_align_log2)
+#define tlsf_small_block_size (1 << tlsf_fl_shift)
+#define tlsf_fl_max 40 //MAX_HEAP_SIZE is 1TB, so no block can reach 2^40 bytes.
+#define tlsf_fl_count (tlsf_fl_max - tlsf_fl_shift + 1)
+
+typedef struct tlsf_control_t
+{
+    uint64_t fl_bitmap;
+    uint32_t sl_bitmap[tlsf_fl_count];
+    node_t* heads[tlsf_fl_count][tlsf_sl_count];
+}tlsf_control_t;
+
+//Position of the highest 1 bit, x must not be 0.
+int tlsf_fls(uint64_t x){
+    return 63 - __builtin_clzll(x);
+}
+
+//Which list the free block of this size goes to.
+void tlsf_mapping_insert(uint64_t size, int* fl, int* sl){
+    if (size < tlsf_small_block_size){
+        *fl = 0;
+        *sl = (int)(size >> tlsf_align_log2);
+    }
+    else{
+        int highest_bit = tlsf_fls(size);
+        *sl = (int)(size >> (highest_bit - tlsf_sl_log2)) ^ tlsf_sl_count;
+        *fl = highest_bit - tlsf_fl_shift + 1;
+        //Remove the highest bit, the next tlsf_sl_log2 bits are the second level index.
+    }
+}
+
+//Which list to start searching for this size: round the size up to the next second level range first,
+//so every block in the found list is large enough and we can take the head without walking the list.
+void tlsf_mapping_search(uint64_t size, int* fl, int* sl){
+    if (size >= tlsf_small_block_size){
+        size += ((uint64_t)1 << (tlsf_fls(size) - tlsf_sl_log2)) - 1;
+    }
+    tlsf_mapping_insert(size, fl, sl);
+}
+
+void tlsf_insert(node_t* currentnode, uint64_t size){
+    int fl, sl;
+    tlsf_mapping_insert(size, &fl, &sl);
+
+    set_prev_node(currentnode, NULL);
+    set_next_node(currentnode, arena->tlsf_control->heads[fl][sl]);
+    if (arena->tlsf_control->heads[fl][sl] != NULL){
+        set_prev_node(arena->tlsf_control->heads[fl][sl], currentnode);
+    }
+    arena->tlsf_control->heads[fl][sl] = currentnode;
+    arena->tlsf_control->fl_bitmap |= (uint64_t)1 << fl;
+    arena->tlsf_control->sl_bitmap[fl] |= (uint32_t)1 << sl;
+}
+
+void tlsf_remove(node_t* currentnode, uint64_t size){
+    int fl, sl;
+    tlsf_mapping_insert(size, &fl, &sl);
+
+    node_t* prev_node = get_prev_node(currentnode);
+    node_t* next_node = get_next_node(currentnode);
+    if (prev_node != NULL){
+        set_next_node(prev_node, next_node);
+    }
+    else{
+        arena->tlsf_control->heads[fl][sl] = next_node;
+        if (next_node == NULL){
+            arena->tlsf_control->sl_bitmap[fl] &= ~((uint32_t)1 << sl);
+            if (arena->tlsf_control->sl_bitmap[fl] == 0){
+                arena->tlsf_control->fl_bitmap &= ~((uint64_t)1 << fl);
+            }
+            //The list is empty now, clear its bit, and the first level bit if the whole range is empty.
+        }
+    }
+    if (next_node != NULL){
+        set_prev_node(next_node, prev_node);
+    }
+}
+
+bool tlsf_control_init(){
+    uint64_t control_size = align(sizeof(tlsf_control_t));
+    arena->tlsf_control = (tlsf_control_t*)mm_sbrk(control_size);
+    if (arena->tlsf_control == (void*) -1){
+        return false;
+    }
+    arena->tlsf_control->fl_bitmap = 0;
+    for (int i = 0; i < tlsf_fl_count; i++){
+        arena->tlsf_control->sl_bitmap[i] = 0;
+        for (int j = 0; j < tlsf_sl_count; j++){
+            arena->tlsf_control->heads[i][j] = NULL;
+        }
+    }
+    return true;
+    //control_size is multiple of 16, so the padding and prelogue after it keep the same alignment.
+}
+
 int go_which_range_freelist(uint64_t size){
     //NOTE: the size includes header and footer size, it's sync with my implicit free list design.
-    //The minimum block size is 32, so lowest range will start at 64 bytes.
-    if(size <= 64){
-        return 0;
-    }
-    else if(size <= 128){
-        return 1;
+    //List i keeps blocks up to 2^(freelist_first_log2 + i) bytes, so the index is just the position of
+    //the highest 1 bit of (size - 1). OR with the first limit - 1 puts every small size in list 0,
+    //and the last list takes everything larger. No branch, the compiler makes the min a cmov.
+    int index = 63 - __builtin_clzll((size - 1) | (((uint64_t)1 << freelist_first_log2) - 1)) - freelist_first_log2 + 1;
+    return index < free_list_num - 1 ? index : free_list_num - 1;
+}
+
+//Large block tree.
+//The last free list (blocks > 16384 bytes) is not a list, it is an AVL tree keyed by block size and then address,
+//freelist_heads[large_tree_index] holds its root. The tree node is stored in the payload of the free block itself,
+//so it never calls the system malloc. Best fit is O(log n), and with the same size the lowest address is taken,
+//which keeps the top of the heap cold.
+#define large_tree_index (free_list_num - 1)
+
+typedef struct large_tree_node_t
+{
+    struct large_tree_node_t* left;
+    struct large_tree_node_t* right;
+    uint64_t height;
+    uint64_t free_epoch;    //arena->decay_epoch when the block went in the tree.
+}large_tree_node_t;
+
+uint64_t get_total_block_size(uint64_t* block_ptr);
+
+uint64_t large_tree_key_size(large_tree_node_t* node){
+    return get_total_block_size((uint64_t*)node - 1);
+    //node is the payload, the size is in the header before it.
+}
+
+//true if node a goes before node b, smaller size first, then lower address.
+bool large_tree_less(large_tree_node_t* a, large_tree_node_t* b){
+    uint64_t size_a = large_tree_key_size(a);
+    uint64_t size_b = large_tree_key_size(b);
+    return size_a < size_b || (size_a == size_b && a < b);
+}
+
+uint64_t large_tree_height(large_tree_node_t* node){
+    return node == NULL ? 0 : node->height;
+}
+
+void large_tree_update_height(large_tree_node_t* node){
+    uint64_t left_height = large_tree_height(node->left);
+    uint64_t right_height = large_tree_height(node->right);
+    node->height = 1 + (left_height > right_height ? left_height : right_height);
+}
+
+large_tree_node_t* large_tree_rotate_right(large_tree_node_t* node){
+    large_tree_node_t* new_root = node->left;
+    node->left = new_root->right;
+    new_root->right = node;
+    large_tree_update_height(node);
+    large_tree_update_height(new_root);
+    return new_root;
+}
+
+large_tree_node_t* large_tree_rotate_left(large_tree_node_t* node){
+    large_tree_node_t* new_root = node->right;
+    node->right = new_root->left;
+    new_root->left = node;
+    large_tree_update_height(node);
+    large_tree_update_height(new_root);
+    return new_root;
+}
+
+//Fix the height of node and rotate if its two sides differ by more than 1, return the new root of this subtree.
+large_tree_node_t* large_tree_balance(large_tree_node_t* node){
+    large_tree_update_height(node);
+    int64_t balance = (int64_t)large_tree_height(node->left) - (int64_t)large_tree_height(node->right);
+    if (balance > 1){
+        if (large_tree_height(node->left->left) < large_tree_height(node->left->right)){
+            node->left = large_tree_rotate_left(node->left);
+        }
+        return large_tree_rotate_right(node);
     }
-    else if(size <= 256){
-        return 2;
+    if (balance < -1){
+        if (large_tree_height(node->right->right) < large_tree_height(node->right->left)){
+            node->right = large_tree_rotate_right(node->right);
+        }
+        return large_tree_rotate_left(node);
     }
-    else if(size <= 512){
-        return 3;
+    return node;
+}
+
+large_tree_node_t* large_tree_insert(large_tree_node_t* root, large_tree_node_t* node){
+    if (root == NULL){
+        node->left = NULL;
+        node->right = NULL;
+        node->height = 1;
+        return node;
     }
-    else if(size <= 1024){
-        return 4;
+    if (large_tree_less(node, root)){
+        root->left = large_tree_insert(root->left, node);
     }
-    else if(size <= 2048){
-        return 5;
+    else{
+        root->right = large_tree_insert(root->right, node);
     }
-    else if(size <= 4096){
-        return 6;
+    return large_tree_balance(root);
+}
+
+large_tree_node_t* large_tree_remove_min(large_tree_node_t* root){
+    if (root->left == NULL){
+        return root->right;
     }
-    else if(size <= 8192){
-        return 7;
+    root->left = large_tree_remove_min(root->left);
+    return large_tree_balance(root);
+}
+
+//node must be in the tree, the (size, address) key finds it.
+large_tree_node_t* large_tree_remove(large_tree_node_t* root, large_tree_node_t* node){
+    if (root == node){
+        if (root->left == NULL){
+            return root->right;
+        }
+        if (root->right == NULL){
+            return root->left;
+        }
+        large_tree_node_t* successor = root->right;
+        while (successor->left != NULL){
+            successor = successor->left;
+        }
+        successor->right = large_tree_remove_min(root->right);
+        successor->left = root->left;
+        return large_tree_balance(successor);
+        //Two children, the smallest node on the right side takes the place of the removed node.
     }
-    else if(size <= 16384){
-        return 8;
+    if (large_tree_less(node, root)){
+        root->left = large_tree_remove(root->left, node);
     }
     else{
-        return 9;
+        root->right = large_tree_remove(root->right, node);
+    }
+    return large_tree_balance(root);
+}
+
+//Smallest block that is at least size bytes, the lowest address one if there are many of the same size.
+large_tree_node_t* large_tree_best_fit(large_tree_node_t* root, uint64_t size){
+    large_tree_node_t* best_node = NULL;
+    while (root != NULL){
+        if (large_tree_key_size(root) >= size){
+            best_node = root;
+            root = root->left;
+        }
+        else{
+            root = root->right;
+        }
     }
+    return best_node;
 }
 
 //Here is the add_to_freelist and remove_from_freelist functions.
 //They will get the array index by the block size to add/remove in corresponse free list. 
 //node_ptr is ptr to payload location.
 void add_to_freelist(uint64_t* node_ptr, uint64_t size){
+    if (FOOTERLESS && size == mini_block_size){
+        mini_free_node_t* mini_node = (mini_free_node_t*) node_ptr;
+        if (!is_mini_node_linkable(mini_node)){
+            return;
+        }
+        mini_node->prev = 0;
+        mini_node->next = mini_node_to_link(arena->mini_freelist_head);
+        if (arena->mini_freelist_head != NULL){
+            arena->mini_freelist_head->prev = mini_node_to_link(mini_node);
+        }
+        arena->mini_freelist_head = mini_node;
+        return;
+        //Mini block goes to the front of mini free list.
+    }
+    if (TLSF){
+        tlsf_insert((node_t*) node_ptr, size);
+        return;
+    }
+
     int freelist_array_index = go_which_range_freelist(size);
     node_t* currentnode = (node_t*) node_ptr;
 
-    if(freelist_heads[freelist_array_index] == NULL){
-        freelist_heads[freelist_array_index] = currentnode;
-        freelist_heads[freelist_array_index]->prev = NULL;
-        freelist_heads[freelist_array_index]->next = NULL;
+    if (freelist_array_index == large_tree_index){
+        large_tree_node_t* root = (large_tree_node_t*) arena->freelist_heads[large_tree_index];
+        ((large_tree_node_t*) node_ptr)->free_epoch = arena->decay_epoch;
+        arena->freelist_heads[large_tree_index] = (node_t*) large_tree_insert(root, (large_tree_node_t*) node_ptr);
+        arena->freelist_bitmap |= (uint64_t)1 << large_tree_index;
+        return;
+        //Large block goes to the tree.
+    }
+
+    if(arena->freelist_heads[freelist_array_index] == NULL){
+        arena->freelist_heads[freelist_array_index] = currentnode;
+        set_prev_node(currentnode, NULL);
+        set_next_node(currentnode, NULL);
+        arena->freelist_bitmap |= (uint64_t)1 << freelist_array_index;
     }
-    else if (freelist_heads[freelist_array_index] != NULL){
-        currentnode->prev = NULL;
-        currentnode->next = freelist_heads[freelist_array_index];
-        freelist_heads[freelist_array_index]->prev = currentnode;
-        freelist_heads[freelist_array_index] = currentnode;
+    else if (arena->freelist_heads[freelist_array_index] != NULL){
+        set_prev_node(currentnode, NULL);
+        set_next_node(currentnode, arena->freelist_heads[freelist_array_index]);
+        set_prev_node(arena->freelist_heads[freelist_array_index], currentnode);
+        arena->freelist_heads[freelist_array_index] = currentnode;
     }
 }
 
 //node_ptr is ptr to payload location.
 //because remove is hard for me, so detail explaination with visualization here.
 void remove_from_freelist(uint64_t* node_ptr, uint64_t size){
+    if (FOOTERLESS && size == mini_block_size){
+        mini_free_node_t* mini_node = (mini_free_node_t*) node_ptr;
+        if (!is_mini_node_linkable(mini_node)){
+            return;
+        }
+        mini_free_node_t* prev_node = mini_link_to_node(mini_node->prev);
+        mini_free_node_t* next_node = mini_link_to_node(mini_node->next);
+        if (prev_node != NULL){
+            prev_node->next = mini_node->next;
+        }
+        else{
+            arena->mini_freelist_head = next_node;
+        }
+        if (next_node != NULL){
+            next_node->prev = mini_node->prev;
+        }
+        return;
+        //Mini free list is doubly linked, so merge() removes a mini block in O(1) too.
+    }
+    if (TLSF){
+        tlsf_remove((node_t*) node_ptr, size);
+        return;
+    }
+
     int freelist_array_index = go_which_range_freelist(size);
     node_t* currentnode = (node_t*) node_ptr;
 
-    if (currentnode->prev != NULL && currentnode->next != NULL){
-        currentnode->prev->next = currentnode->next;
-        currentnode->next->prev = currentnode->prev;
+    if (freelist_array_index == large_tree_index){
+        large_tree_node_t* root = (large_tree_node_t*) arena->freelist_heads[large_tree_index];
+        arena->freelist_heads[large_tree_index] = (node_t*) large_tree_remove(root, (large_tree_node_t*) node_ptr);
+        if (arena->freelist_heads[large_tree_index] == NULL){
+            arena->freelist_bitmap &= ~((uint64_t)1 << large_tree_index);
+        }
+        return;
+    }
+
+    node_t* prev_node = get_prev_node(currentnode);
+    node_t* next_node = get_next_node(currentnode);
+    if (prev_node != NULL && next_node != NULL){
+        set_next_node(prev_node, next_node);
+        set_prev_node(next_node, prev_node);
         //remove the block in middle of free block list
         //prev_block - curr_block - next_block
         //the prev_block(head)'s next will be the next_block.
@@ -198,14 +872,15 @@ void remove_from_freelist(uint64_t* node_ptr, uint64_t size){
         //and next_block prev point to prev_block(head).
         //prev_block - next_block
     }
-    else if((currentnode->prev == NULL && currentnode->next == NULL)){
-        freelist_heads[freelist_array_index] = NULL;
+    else if((prev_node == NULL && next_node == NULL)){
+        arena->freelist_heads[freelist_array_index] = NULL;
+        arena->freelist_bitmap &= ~((uint64_t)1 << freelist_array_index);
         //this is remove the only element in the freelist.
-        //so just make freelist_head = null to make the list empty.
+        //so just make freelist_head = null to make the list empty, and clear its bit in the bitmap.
     }
-    else if(currentnode->prev == NULL){
-        freelist_heads[freelist_array_index] = currentnode->next;
-        freelist_heads[freelist_array_index]->prev = NULL;
+    else if(prev_node == NULL){
+        arena->freelist_heads[freelist_array_index] = next_node;
+        set_prev_node(next_node, NULL);
         //remove the block in the beginning of freeblock list
         //curr_block(head) - next_block
         //the prev_block's next will be the head.
@@ -213,8 +888,8 @@ void remove_from_freelist(uint64_t* node_ptr, uint64_t size){
         //and make new head prev point to NULL.
         //NULL - next_block(new head)
     }
-    else if(currentnode->next == NULL){
-        currentnode->prev->next = NULL;
+    else if(next_node == NULL){
+        set_next_node(prev_node, NULL);
         //remove the block in the end of the free block list
         //prev_block - curr_block - NULL
         //we just make prev_block's next point to NULL
@@ -223,33 +898,201 @@ void remove_from_freelist(uint64_t* node_ptr, uint64_t size){
 }
 
 
-/*
- * mm_init: returns false on error, true on success.
- */
-bool mm_init(void)
-{
-    // IMPLEMENT THIS
-    // Initialize the freelist array.
-    free_list_array_init();
+//Quick lists, list i keeps the blocks of size (i + 1) * 16 that were freed but not merged yet.
+//The blocks are still allocated in the heap, the payload is only used for the next*.
+#define quick_list_num 16
+#define quick_max_block_size (quick_list_num * 16)
+
+//Slab runs, a run is one page aligned page of same size slots for requests up to slab_max_size bytes.
+//The run header is at the beginning of the page, free_bitmap bit i is 1 when slot i is free.
+//The whole page is the payload of one allocated heap block, so the heap checker just sees a normal block.
+#define slab_run_size 4096
+#define slab_run_log2 12
+#define slab_class_num 16
+#define slab_max_size (slab_class_num * 16)
+#define slab_bitmap_words 4 //16 bytes slots, at most 4096 / 16 = 256 slots.
 
-    // we need allocate 4 blocks of size for padding, prelogue and eqilogue.
-    heap_pre_before_padding = (uint64_t *)mm_sbrk(32);
-    if(heap_pre_before_padding ==(void *) -1){
+typedef struct slab_run_t
+{
+    struct slab_run_t* prev;
+    struct slab_run_t* next;
+    uint32_t slot_size;
+    uint32_t slot_count;
+    uint32_t free_count;
+    uint32_t class_index;
+    uint64_t free_bitmap[slab_bitmap_words];
+}slab_run_t;
+
+#define slab_run_header_size sizeof(slab_run_t)
+
+//State of the small block paths. Like TLSF, the control block lives at the beginning of heap.
+//slab_heads[i] is the list of runs of slot size (i + 1) * 16 that still have a free slot.
+//run_map bit i is 1 when heap page i is a slab run, free() asks it before reading any header.
+typedef struct small_control_t
+{
+    mini_node_t* quick_heads[quick_list_num];
+    uint32_t quick_counts[quick_list_num];
+    uint32_t quick_bitmap;    //Bit i is 1 when quick_heads[i] is not empty.
+    slab_run_t* slab_heads[slab_class_num];
+    uint64_t* run_map;
+    uint64_t run_map_pages;    //How many pages run_map can tell, always multiple of 64.
+    char* heap_base;
+}small_control_t;
+
+bool small_control_init(){
+    uint64_t control_size = align(sizeof(small_control_t));
+    arena->small_control = (small_control_t*)mm_sbrk(control_size);
+    if (arena->small_control == (void*) -1){
         return false;
-    } 
+    }
+    for (int i = 0; i < quick_list_num; i++){
+        arena->small_control->quick_heads[i] = NULL;
+        arena->small_control->quick_counts[i] = 0;
+    }
+    arena->small_control->quick_bitmap = 0;
+    for (int i = 0; i < slab_class_num; i++){
+        arena->small_control->slab_heads[i] = NULL;
+    }
+    arena->small_control->run_map = NULL;
+    arena->small_control->run_map_pages = 0;
+    arena->small_control->heap_base = (char*)mm_heap_lo();
+    return true;
+}
+
+int quick_list_index(uint64_t size){
+    return (int)(size / 16) - 1;
+}
+
+//They need merge(), so they are after it.
+void quick_list_flush_all();
+void quick_list_push(uint64_t* block_ptr, uint64_t size);
+void* slab_malloc(size_t size);
+slab_run_t* get_slab_run(void* ptr);
+bool tcache_flush_arena_blocks();
+bool percpu_flush_cpu_blocks();
+void arena_free(void* ptr);
+void remote_free_drain();
+void remote_free_push(arena_t* owner_arena, mini_node_t* first, mini_node_t* last);
+
+
+void lock_arena(arena_t* locking_arena){
+    if (ARENA_NUM > 1){
+        pthread_mutex_lock(&locking_arena->lock);
+    }
+}
+
+void unlock_arena(arena_t* locking_arena){
+    if (ARENA_NUM > 1){
+        pthread_mutex_unlock(&locking_arena->lock);
+    }
+}
 
-    heap_pre = (uint64_t*)((char*)heap_pre_before_padding + header_size);
-    //We add 8bytes padding at the beginning to align with 16 bytes.
-    //8bytes padding + (header ----8bytes---- footer ----8bytes----) + + (epilogue ----8bytes----)
+void lock_heap(){
+    if (ARENA_NUM > 1){
+        pthread_mutex_lock(&heap_lock);
+    }
+}
 
-    *heap_pre = (header_size + footer_size) | 0x1;    //header of prelogue
-    *(uint64_t *)((char*)heap_pre + header_size) = (header_size + footer_size)  | 0x1;    //footer of prelogue
+void unlock_heap(){
+    if (ARENA_NUM > 1){
+        pthread_mutex_unlock(&heap_lock);
+    }
+}
 
-    heap_epi = (uint64_t*)((char*) heap_pre + header_size + footer_size);    //header pointer of epilogue, and it doesnt have footer.
-    *heap_epi = 0x0000000000000000 | 0x0000000000000001;   //Epilogue value: 0x1
+bool add_heap_chunk(uint64_t free_block_size);
 
+//Make arena number index at the end of heap, and make it the arena of this thread.
+//Caller holds heap_lock (or it is mm_init).
+bool arena_create(uint32_t index){
+    arena_t* new_arena = (arena_t*)mm_sbrk(align(sizeof(arena_t)));
+    if (new_arena == (void*) -1){
+        return false;
+    }
+    arena = new_arena;
+    arena->heap_pre = NULL;
+    arena->heap_epi = NULL;
+    arena->last_chunk_pre = NULL;
+    arena->header_bits = (uint64_t)index << arena_index_shift;
+    arena->tlsf_control = NULL;
+    arena->small_control = NULL;
+    arena->remote_free_head = NULL;
+    arena->decay_epoch = 0;
+    arena->decay_free_count = 0;
+    arena->trim_pad = 0;
+    arena->regrow_size = 0;
+    if (ARENA_NUM > 1){
+        pthread_mutex_init(&arena->lock, NULL);
+    }
+    // Initialize the freelist array.
+    free_list_array_init();
+    if (TLSF && !tlsf_control_init()){
+        return false;
+    }
+    if ((QUICK_LIST_LIMIT > 0 || SLAB) && !small_control_init()){
+        return false;
+    }
+    if (!add_heap_chunk(0)){
+        return false;
+    }
+    arena_table[index] = arena;
     return true;
-    //We apply 32 bytes space, but only use 24 bytes. 32 satisfy the alignment of 16 bytes.
+}
+
+//The arena of this thread, the first call of a thread binds it to the next arena (round robin).
+arena_t* get_thread_arena(){
+    if (arena != NULL){
+        return arena;
+    }
+    lock_heap();
+    uint32_t index = arena_bind_count++ % arena_max_num;
+    if (arena_table[index] != NULL){
+        arena = arena_table[index];
+    }
+    else if (!arena_create(index)){
+        arena = NULL;
+    }
+    unlock_heap();
+    return arena;
+}
+
+//Which arena the allocated block of ptr belongs to.
+arena_t* get_block_arena(void* ptr){
+    if (ARENA_NUM <= 1){
+        return get_thread_arena();
+        //Only one arena, and a slab slot has no header to read.
+    }
+    return arena_table[(*((uint64_t*)ptr - 1) >> arena_index_shift) & arena_index_mask];
+}
+
+/*
+ * mm_init: returns false on error, true on success.
+ */
+bool mm_init(void)
+{
+    // IMPLEMENT THIS
+    arena_table = (arena_t**)mm_sbrk(align(sizeof(arena_t*) * arena_max_num));
+    if (arena_table == (void*) -1){
+        return false;
+    }
+    for (int i = 0; i < arena_max_num; i++){
+        arena_table[i] = NULL;
+    }
+    arena_bind_count = 1;
+    tcache = NULL;
+    percpu_table = NULL;
+    if (percpu_enabled){
+        long cpu_num = sysconf(_SC_NPROCESSORS_CONF);
+        percpu_cpu_num = cpu_num > 0 ? (uint32_t)cpu_num : 1;
+        percpu_table = (percpu_cache_t**)mm_sbrk(align(sizeof(percpu_cache_t*) * percpu_cpu_num));
+        if (percpu_table == (void*) -1){
+            return false;
+        }
+        for (uint32_t i = 0; i < percpu_cpu_num; i++){
+            percpu_table[i] = NULL;
+        }
+    }
+    //This thread gets arena 0, the next thread binds to arena 1, the old thread cache was in the old heap.
+    return arena_create(0);
 }
 
 
@@ -268,13 +1111,24 @@ uint64_t pack(uint64_t size, uint64_t alloc_status){
 }
 
 uint64_t get_total_block_size(uint64_t* block_ptr){
-    return *block_ptr & 0xFFFFFFFFFFFFFFF0;
-    // 0xFFFFFFFFFFFFFFF0 is 1111...60's 1...0000, using & will only remain the 1 in the header and ingore the last bit f/a
+    return *block_ptr & 0x0000FFFFFFFFFFF0;
+    // 0x0000FFFFFFFFFFF0 is 36's 1...0000, using & will only remain the 1 in the header and ingore the last bit f/a
+    // and the arena index in the top bits, block size is always less than 1TB anyway.
 }
 
 uint64_t is_block_allocated(uint64_t* block_ptr){
-    return *block_ptr & 0x000000000000000F;
-    //0x000000000000000F is 0000000...60's 0...1111, using & will check weather last bit is 0 or 1. if 1 return 1 acclocated, if 0 return 0 free.
+    return *block_ptr & alloc_bit;
+    //alloc_bit is 0000000...63's 0...1, using & will check weather last bit is 0 or 1. if 1 return 1 acclocated, if 0 return 0 free.
+}
+
+uint64_t is_prev_block_allocated(uint64_t* block_ptr){
+    return (*block_ptr & prev_alloc_bit) >> 1;
+    //Only valid in FOOTERLESS mode, bit 1 of the header is the previous block status.
+}
+
+uint64_t is_prev_block_mini(uint64_t* block_ptr){
+    return (*block_ptr & prev_mini_bit) >> 2;
+    //Only valid in FOOTERLESS mode, bit 2 of the header tells the previous block is 16 bytes.
 }
 
 
@@ -292,201 +1146,1428 @@ uint64_t* get_header_ptr(uint64_t* payload_ptr){
     return (uint64_t*)((char*)payload_ptr - header_size);
 }
 
+uint64_t* get_footer_ptr(uint64_t* block_ptr){
+    return (uint64_t*)((char*)block_ptr + get_total_block_size(block_ptr) - footer_size);
+    //The footer is the last 8 bytes of the block, header must already have the right size.
+}
 
-// Split and allocate block is where the block got allocated and extra will be set back to free and add back to free list.
-uint64_t* split_and_allocate_block(uint64_t* block_ptr, uint64_t allocating_size){
-    if (block_ptr == NULL){
-        return NULL;
+//Set the header of the block, and keep the prev_alloc_bit and prev_mini_bit it already has.
+void put_header(uint64_t* block_ptr, uint64_t size, uint64_t alloc_status){
+    put(block_ptr, pack(size, alloc_status) | (*block_ptr & (prev_alloc_bit | prev_mini_bit)) | arena->header_bits);
+}
+
+//Set the header of the block and also the footer, allocated block and mini block in FOOTERLESS mode has no footer.
+void put_header_footer(uint64_t* block_ptr, uint64_t size, uint64_t alloc_status){
+    put_header(block_ptr, size, alloc_status);
+    if (!FOOTERLESS || (alloc_status == 0 && size != mini_block_size)){
+        put(get_footer_ptr(block_ptr), pack(size, alloc_status));
+    }
+}
+
+//Tell the next block (maybe the epilogue) weather this block is allocated or not, and weather it is a mini block.
+//Call it every time the status or the size of the block changed.
+void set_next_prev_alloc(uint64_t* block_ptr, uint64_t alloc_status){
+    if (FOOTERLESS){
+        uint64_t* next_block = get_next_block(block_ptr);
+        uint64_t prev_bits = 0;
+        if (alloc_status){
+            prev_bits |= prev_alloc_bit;
+        }
+        if (get_total_block_size(block_ptr) == mini_block_size){
+            prev_bits |= prev_mini_bit;
+        }
+        *next_block = (*next_block & ~(uint64_t)(prev_alloc_bit | prev_mini_bit)) | prev_bits;
     }
+}
+
 
-    //the block_allocating is the block we found free and larger than asked size allocating_size + 32bytes (1 pair header footer for data,1 pair for rest of free block) 
+// Split and allocate block is where the block got allocated and extra will be set back to free and add back to free list.
+uint64_t* split_and_allocate_block(uint64_t* block_ptr, uint64_t allocating_size){
+    if (block_ptr == NULL){
+        return NULL;
+    }
+
+    //the block_allocating is the block we found free and larger than asked size allocating_size + min_block_size (the rest must still be a valid free block)
     uint64_t block_allocating = get_total_block_size(block_ptr);
-    if (block_allocating >= ((uint64_t)allocating_size + header_size + footer_size + header_size + footer_size)){         //32 is for minimum size of block
-        put(block_ptr,(pack(allocating_size,1)));
-        uint64_t* footer_ptr = (uint64_t*)((char*)block_ptr + allocating_size - footer_size);
-        put(footer_ptr,pack(allocating_size,1));
+    if (block_allocating >= ((uint64_t)allocating_size + min_block_size)){
+        bool zero_pages = is_block_allocated(block_ptr) == 0 && (*block_ptr & zero_pages_bit) != 0;
+        put_header_footer(block_ptr, allocating_size, 1);
         //Allocated block header and footer setting.
 
         uint64_t left_free_block_size = block_allocating - allocating_size;
         uint64_t* left_free_block_ptr = (uint64_t*)((char*)block_ptr + allocating_size);
-        put(left_free_block_ptr,pack(left_free_block_size,0));    
-        uint64_t free_payload_left_size = left_free_block_size - footer_size - header_size;
-        uint64_t* left_free_block_footer_ptr = (uint64_t*)((char*)left_free_block_ptr + free_payload_left_size + header_size);
-        put(left_free_block_footer_ptr,pack(left_free_block_size,0));
-        //Left free extra block header and footer setting.
+        put(left_free_block_ptr, 0);
+        set_next_prev_alloc(block_ptr, 1);
+        put_header_footer(left_free_block_ptr, left_free_block_size, 0);
+        set_next_prev_alloc(left_free_block_ptr, 0);
+        //Left free extra block header and footer setting, its prev block is the one just allocated.
+        //The block after it now follows the left free block, it can be a mini block in FOOTERLESS mode.
+        if (zero_pages){
+            *left_free_block_ptr |= zero_pages_bit;
+        }
+        //The zero pages of the left block are inside the zero pages of the whole block, nothing wrote them.
         add_to_freelist(get_payload_ptr(left_free_block_ptr), left_free_block_size);
         //Put the extra free block back to free list.
 
         return block_ptr;
     }
     else{
-        put(block_ptr,pack(block_allocating,1));
-        put((uint64_t*)((char*)block_ptr + block_allocating - footer_size),pack(block_allocating,1));
+        put_header_footer(block_ptr, block_allocating, 1);
+        set_next_prev_alloc(block_ptr, 1);
         return block_ptr;
         //Left free block is smaller than minimum block size, So just allocate it without split.
     }
 }
 
+//In COMPRESSED_LINKS mode the heap can not grow beyond what a 32 bits link can reach.
+bool heap_can_grow(uint64_t grow_size){
+    return !COMPRESSED_LINKS || (uint64_t)((char*)mm_heap_hi() + 1 + grow_size - (char*)arena->heap_pre) <= compressed_heap_max_size;
+}
+
+//The epilogue of this arena is the last word of heap, so the arena can grow by moving it. Caller holds heap_lock.
+bool heap_epi_at_brk(){
+    return (char*)arena->heap_epi + header_size == (char*)mm_heap_hi() + 1;
+}
+
+//The zero pages of a free block: the whole pages after the tree node and before the footer,
+//mm_purge gives back only these so the tags and links of the block stay.
+char* get_zero_pages_lo(uint64_t* block_ptr){
+    uintptr_t page_size = mm_pagesize();
+    return (char*)(((uintptr_t)get_payload_ptr(block_ptr) + sizeof(large_tree_node_t) + page_size - 1) & ~(page_size - 1));
+}
+//Returns false if the block has no zero_pages_bit.
+bool get_zero_pages_range(uint64_t* block_ptr, char** zero_lo, char** zero_hi){
+    if (is_block_allocated(block_ptr) != 0 || (*block_ptr & zero_pages_bit) == 0){
+        return false;
+    }
+    *zero_lo = get_zero_pages_lo(block_ptr);
+    *zero_hi = (char*)((uintptr_t)get_footer_ptr(block_ptr) & ~(uintptr_t)(mm_pagesize() - 1));
+    if (*zero_hi < *zero_lo){
+        *zero_hi = *zero_lo;
+    }
+    return true;
+}
+
+//Start a new chunk of this arena at the end of heap, with a free block of free_block_size (can be 0) in it.
+//The free block is not in the free list. Caller holds heap_lock.
+//8bytes link to the next chunk + (header ----8bytes---- footer ----8bytes----) + [free block] + (epilogue ----8bytes----)
+bool add_heap_chunk(uint64_t free_block_size){
+    char* zero_lo = (char*)mm_zero_lo();
+    uint64_t* chunk_ptr = (uint64_t*)mm_sbrk(free_block_size + 32);
+    if (chunk_ptr == (void*) -1){
+        return false;
+    }
+    uint64_t* chunk_pre = chunk_ptr + 1;
+    put(chunk_ptr, 0);    //No next chunk yet.
+    put(chunk_pre, (header_size + footer_size) | 0x1);    //header of prelogue
+    put(chunk_pre + 1, (header_size + footer_size) | 0x1);    //footer of prelogue
+    if (arena->heap_pre == NULL){
+        arena->heap_pre = chunk_pre;
+    }
+    else{
+        put(arena->last_chunk_pre - 1, (uint64_t)chunk_pre);
+    }
+    arena->last_chunk_pre = chunk_pre;
+
+    uint64_t* first_block = chunk_pre + 2;
+    arena->heap_epi = (uint64_t*)((char*)first_block + free_block_size);    //header pointer of epilogue, and it doesnt have footer.
+    put(arena->heap_epi, 0x0000000000000000 | 0x0000000000000001);    //Epilogue value: 0x1
+    if (free_block_size > 0){
+        put(first_block, FOOTERLESS ? prev_alloc_bit : 0);    //the prelogue before it is allocated.
+        put_header_footer(first_block, free_block_size, 0);
+        set_next_prev_alloc(first_block, 0);
+        if (get_zero_pages_lo(first_block) >= zero_lo){
+            *first_block |= zero_pages_bit;
+        }
+        //The free block just came from mm_sbrk, so it is zero unless an old heap was left there.
+    }
+    else if (FOOTERLESS){
+        *arena->heap_epi |= prev_alloc_bit;    //Epilogue value: 0x3, the prelogue before it is allocated.
+    }
+    return true;
+}
+
+//Where expand_heap will put the new block: the last block if it is free, or the epilogue.
+uint64_t* get_heap_tail_block(){
+    bool last_is_free;
+    if (FOOTERLESS){
+        last_is_free = (is_prev_block_allocated(arena->heap_epi) == 0);
+    }
+    else{
+        last_is_free = (is_block_allocated(arena->heap_epi - 1) == 0);
+    }
+    if (!last_is_free){
+        return arena->heap_epi;
+    }
+    if (FOOTERLESS && is_prev_block_mini(arena->heap_epi)){
+        return (uint64_t*)((char*)arena->heap_epi - mini_block_size);
+    }
+    return (uint64_t*)((char*)arena->heap_epi - get_total_block_size(arena->heap_epi - 1));
+    //the footer of the last free block is just before the epilogue.
+}
+
+//Get a free block of at least new_block_size at the end of heap, it is not in the free list.
+//If the last block before the epilogue is free, it is reused and only the missing bytes are asked from mm_sbrk.
 uint64_t* expand_heap(uint64_t new_block_size){
-    void* new_ptr = mm_sbrk(new_block_size);
+    lock_heap();
+    if (!heap_epi_at_brk()){
+        uint64_t chunk_block_size = new_block_size > arena_chunk_size ? new_block_size : arena_chunk_size;
+        bool chunk_added = heap_can_grow(chunk_block_size + 32) && add_heap_chunk(chunk_block_size);
+        unlock_heap();
+        return chunk_added ? get_heap_tail_block() : NULL;
+        //Another arena is at the end of heap, so the new block is in a new chunk.
+    }
+    uint64_t* newblock_header = get_heap_tail_block();
+    char* zero_lo = (char*)mm_zero_lo();
+    uint64_t last_free_size = (uint64_t)((char*)arena->heap_epi - (char*)newblock_header);
+    bool last_is_free = (last_free_size != 0);
+
+    uint64_t grow_size = 0;
+    if (new_block_size > last_free_size){
+        grow_size = new_block_size - last_free_size;
+    }
+    uint64_t min_grow_size = align(MIN_HEAP_GROW);
+    if (grow_size < min_grow_size){
+        grow_size = min_grow_size;
+    }
+    void* new_ptr = heap_can_grow(grow_size) ? mm_sbrk(grow_size) : (void*) -1;
+    unlock_heap();
     if(new_ptr ==(void*) -1){
         return NULL;
     }
+    if (arena->trim_pad != 0){
+        arena->regrow_size += grow_size;
+    }
+    if (last_is_free){
+        remove_from_freelist(get_payload_ptr(newblock_header), last_free_size);
+    }
+    new_block_size = last_free_size + grow_size;
     
-    uint64_t* newblock_header = heap_epi;
-    *newblock_header = (new_block_size) | 0;         //Header of new block
-    *(uint64_t *)((char*)newblock_header + new_block_size - footer_size) = (new_block_size) | 0;    //Footer of new block
-    heap_epi = (uint64_t*)((char*)newblock_header + new_block_size);
-    *heap_epi = 0x0000000000000000 | 0x0000000000000001;        //Reset the epilogue at the end of heap.
+    put_header_footer(newblock_header, new_block_size, 0);    //Header and footer of new block, it keeps the prev bit of old epilogue (or old last free block).
+    arena->heap_epi = (uint64_t*)((char*)newblock_header + new_block_size);
+    *arena->heap_epi = 0x0000000000000000 | 0x0000000000000001;        //Reset the epilogue at the end of heap, its prev block is free now.
+    set_next_prev_alloc(newblock_header, 0);
+    if (get_zero_pages_lo(newblock_header) >= zero_lo){
+        *newblock_header |= zero_pages_bit;
+    }
+    //Memory from mm_sbrk is zero, if the old last free block ends before the zero pages start they are all new.
     return newblock_header;
 }
 
+//Give the free block before the epilogue back to mm_sbrk, except trim_pad bytes of it, if that is TRIM_THRESHOLD bytes or more.
+//The pad starts at TRIM_THRESHOLD. When the heap grew back by TRIM_THRESHOLD or more since the last trim, the memory
+//given back was needed again, so the pad becomes this whole block and a loop that frees and mallocs the top of heap
+//stops paying mm_sbrk and page faults every time (the pages of the pad are still purged by decay_tick).
+//Only the arena at the end of heap can lower the break.
+void trim_heap(uint64_t* block_ptr){
+    uint64_t block_size = get_total_block_size(block_ptr);
+    uint64_t trim_threshold = TRIM_THRESHOLD;
+    if (block_size < 2 * trim_threshold || get_next_block(block_ptr) != arena->heap_epi){
+        return;
+    }
+    if (arena->trim_pad == 0){
+        arena->trim_pad = trim_threshold;
+    }
+    else if (arena->regrow_size >= trim_threshold && arena->trim_pad < block_size){
+        arena->trim_pad = block_size;
+    }
+    arena->regrow_size = 0;
+    if (block_size - arena->trim_pad < trim_threshold){
+        return;
+    }
+    lock_heap();
+    if (!heap_epi_at_brk()){
+        unlock_heap();
+        return;
+    }
+    uint64_t trim_size = block_size - arena->trim_pad;
+    remove_from_freelist(get_payload_ptr(block_ptr), block_size);
+    put_header_footer(block_ptr, arena->trim_pad, 0);
+    add_to_freelist(get_payload_ptr(block_ptr), arena->trim_pad);
+    arena->heap_epi = get_next_block(block_ptr);
+    *arena->heap_epi = 0x0000000000000000 | 0x0000000000000001;
+    set_next_prev_alloc(block_ptr, 0);
+    //The pad stays as the last free block, the new epilogue is after it.
+    mm_sbrk(-(intptr_t)trim_size);
+    unlock_heap();
+}
+
+//Purge the blocks in the large tree that went in before the last epoch and are not purged yet.
+void large_tree_purge(large_tree_node_t* node){
+    if (node == NULL){
+        return;
+    }
+    large_tree_purge(node->left);
+    uint64_t* header = get_header_ptr((uint64_t*)node);
+    if ((*header & zero_pages_bit) == 0 && node->free_epoch + 1 < arena->decay_epoch){
+        char* purge_lo = (char*)(node + 1);
+        mm_purge(purge_lo, (char*)get_footer_ptr(header) - purge_lo);
+        *header |= zero_pages_bit;
+    }
+    large_tree_purge(node->right);
+}
+
+//Count one free in this arena, every DECAY_FREES frees start a new epoch and purge the old free blocks.
+void decay_tick(){
+    uint64_t decay_frees = DECAY_FREES;
+    if (decay_frees == 0 || TLSF){
+        return;
+    }
+    arena->decay_free_count++;
+    if (arena->decay_free_count < decay_frees){
+        return;
+    }
+    arena->decay_free_count = 0;
+    arena->decay_epoch++;
+    large_tree_purge((large_tree_node_t*) arena->freelist_heads[large_tree_index]);
+}
+
+node_t* tlsf_find_fit(uint64_t size){
+    int fl, sl;
+    tlsf_mapping_search(size, &fl, &sl);
+
+    if (fl < tlsf_fl_count){
+        uint32_t sl_map = arena->tlsf_control->sl_bitmap[fl] & (~(uint32_t)0 << sl);
+        if (sl_map == 0){
+            uint64_t fl_map = arena->tlsf_control->fl_bitmap & (~(uint64_t)0 << (fl + 1));
+            if (fl_map != 0){
+                fl = __builtin_ctzll(fl_map);
+                sl_map = arena->tlsf_control->sl_bitmap[fl];
+            }
+            //No list in this first level range, go to the smallest non-empty larger range.
+        }
+        if (sl_map != 0){
+            sl = __builtin_ctz(sl_map);
+            return arena->tlsf_control->heads[fl][sl];
+        }
+    }
+
+    //Nothing larger, the list of the size itself may still have a large enough block (it was skipped by the round up).
+    //Only walk it on the miss, so the heap does not grow when a block already fits.
+    tlsf_mapping_insert(size, &fl, &sl);
+    for (node_t* current_block = arena->tlsf_control->heads[fl][sl]; current_block != NULL; current_block = get_next_node(current_block)){
+        if (get_total_block_size(get_header_ptr((uint64_t*)current_block)) >= size){
+            return current_block;
+        }
+    }
+    return NULL;
+}
+
 node_t* find_firstfit_in_free_list(uint64_t size){
-    int freelist_array_index = go_which_range_freelist(size);
+    if (FOOTERLESS && size == mini_block_size && arena->mini_freelist_head != NULL){
+        return (node_t*) arena->mini_freelist_head;
+        //Any free mini block fits, the remove of the head is O(1).
+    }
+    if (TLSF){
+        return tlsf_find_fit(size);
+    }
 
-    for (int i = freelist_array_index; i < free_list_num; i++){
-        node_t* current_block = freelist_heads[i];
-        if (current_block == NULL){     
-            continue;      
-            //If this free list is empty, try next bigger freelist. 
+    int freelist_array_index = go_which_range_freelist(size);
+    uint64_t nonempty_lists = arena->freelist_bitmap & (~(uint64_t)0 << freelist_array_index);
+    //Only the lists from this range and up that are not empty, so empty free lists are never touched.
+
+    node_t* best_block = NULL;
+    uint64_t best_size = 0;
+    int candidates = 0;
+    while (nonempty_lists != 0){
+        int i = __builtin_ctzll(nonempty_lists);
+        if (i == large_tree_index){
+            return (node_t*) large_tree_best_fit((large_tree_node_t*) arena->freelist_heads[large_tree_index], size);
+            //Large blocks are in the tree, the best fit is O(log n).
         }
-        else{
-            //if the free list is not empty, find suitable free block in free list.
-            while(current_block != NULL){
-                if (get_total_block_size(get_header_ptr((uint64_t*)current_block)) >= size){
-                    return current_block;
+        node_t* current_block = arena->freelist_heads[i];
+        //find suitable free block in free list, keep the tightest one of the first FIT_SEARCH_LIMIT that fit.
+        while(current_block != NULL){
+            uint64_t current_size = get_total_block_size(get_header_ptr((uint64_t*)current_block));
+            if (current_size >= size){
+                if (best_block == NULL || current_size < best_size){
+                    best_block = current_block;
+                    best_size = current_size;
+                }
+                candidates++;
+                if (best_size - size <= FIT_SLACK || candidates >= FIT_SEARCH_LIMIT){
+                    return best_block;
+                    //Good enough or searched enough.
                 }
-                current_block = current_block->next;
             }
+            current_block = get_next_node(current_block);
+        }
+        if (best_block != NULL){
+            return best_block;
+            //Every block in bigger list is bigger than this one, no need to look further.
+        }
+        nonempty_lists &= nonempty_lists - 1;
+        //Nothing fits in this list, clear its bit and try the next bigger non-empty freelist.
+    }
+    return NULL;
+}
+
+
+
+//The whole block size (with header, and footer if not FOOTERLESS) to hold size bytes of payload.
+uint64_t get_aligned_block_size(size_t size){
+    // Check the valid and minimum size, min size is 32, so it can hold prev* and next* after free.
+    // In FOOTERLESS mode request of 8 bytes or less gets a 16 bytes mini block.
+    uint64_t total_block_size =(uint64_t)align(size+alloc_overhead);
+    if (total_block_size < min_block_size){
+        total_block_size = min_block_size;
+    }
+    return total_block_size;
+}
+
+//Find a free block of at least total_block_size and take it out of the free list,
+//if nothing fits, merge the blocks waiting in quick lists (and this thread's cache) and try again before asking for more heap.
+uint64_t* get_free_block(uint64_t total_block_size){
+    if (ARENA_NUM > 1){
+        remote_free_drain();
+    }
+    node_t* find_ptr = find_firstfit_in_free_list(total_block_size);
+    if (find_ptr == NULL && percpu_enabled && percpu_flush_cpu_blocks()){
+        find_ptr = find_firstfit_in_free_list(total_block_size);
+        //Without quick lists the flushed blocks are merged into the free lists already,
+        //with them small blocks go to the quick lists and the flush below merges them.
+    }
+    if (find_ptr == NULL && QUICK_LIST_LIMIT > 0 && arena->small_control->quick_bitmap != 0){
+        quick_list_flush_all();
+        find_ptr = find_firstfit_in_free_list(total_block_size);
+    }
+    if (find_ptr == NULL && tcache_enabled && tcache != NULL && tcache_flush_arena_blocks()){
+        find_ptr = find_firstfit_in_free_list(total_block_size);
+    }
+    if (find_ptr == NULL){
+        return expand_heap(total_block_size);
+    }
+    remove_from_freelist((uint64_t*)find_ptr,get_total_block_size(get_header_ptr((uint64_t*)find_ptr)));
+    return get_header_ptr((uint64_t*)find_ptr);
+}
+
+//malloc in the arena of this thread, the caller holds the arena lock.
+void* arena_malloc(size_t size)
+{
+    // IMPLEMENT THIS FROM HINT
+    if (size == 0){return NULL;}
+    if (SLAB && size <= slab_max_size){
+        return slab_malloc(size);
+    }
+
+    uint64_t total_block_size = get_aligned_block_size(size);
+    uint64_t* current_ptr;
+
+    if (QUICK_LIST_LIMIT > 0 && total_block_size <= quick_max_block_size){
+        int quick_index = quick_list_index(total_block_size);
+        mini_node_t* quick_block = arena->small_control->quick_heads[quick_index];
+        if (quick_block != NULL){
+            arena->small_control->quick_heads[quick_index] = quick_block->next;
+            arena->small_control->quick_counts[quick_index]--;
+            if (quick_block->next == NULL){
+                arena->small_control->quick_bitmap &= ~((uint32_t)1 << quick_index);
+            }
+            return quick_block;
+        }
+        //The block in quick list is still allocated and has the exact size, nothing else to do.
+    }
+
+    // Explicit find fit and allocate:
+    current_ptr = get_free_block(total_block_size);
+    if (current_ptr == NULL){
+        return NULL;
+    }
+    //dbg_printf("malloc size %ld and aligned size is %ld at %p\n", size, total_block_size, current_ptr);
+    uint64_t* after_allocated_current_ptr = split_and_allocate_block(current_ptr,total_block_size);
+    return get_payload_ptr(after_allocated_current_ptr);
+}
+
+//calloc of a block from the free list or the end of heap, the caller holds the arena lock.
+//Only the bytes outside the zero pages of the free block are cleared.
+void* arena_calloc(size_t size){
+    uint64_t total_block_size = get_aligned_block_size(size);
+    uint64_t* block_ptr = get_free_block(total_block_size);
+    if (block_ptr == NULL){
+        return NULL;
+    }
+    char* zero_lo;
+    char* zero_hi;
+    bool has_zero_pages = get_zero_pages_range(block_ptr, &zero_lo, &zero_hi);
+    char* payload = (char*) get_payload_ptr(split_and_allocate_block(block_ptr, total_block_size));
+    char* payload_end = payload + size;
+    if (!has_zero_pages || zero_lo >= payload_end){
+        memset(payload, 0, size);
+        return payload;
+    }
+    memset(payload, 0, zero_lo - payload);
+    if (zero_hi < payload_end){
+        memset(zero_hi, 0, payload_end - zero_hi);
+    }
+    //split_and_allocate_block only writes the tags after the payload, the zero pages in it are still zero.
+    return payload;
+}
+
+int tcache_bin_index(uint64_t size){
+    return (int)(size / 16) - 1;
+}
+
+//Push the allocated blocks first ... last (linked by next) to the remote free stack of owner_arena, no lock.
+void remote_free_push(arena_t* owner_arena, mini_node_t* first, mini_node_t* last){
+    mini_node_t* head = __atomic_load_n(&owner_arena->remote_free_head, __ATOMIC_RELAXED);
+    do {
+        last->next = head;
+    } while (!__atomic_compare_exchange_n(&owner_arena->remote_free_head, &head, first, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    //A failed compare and swap reloads head, so only last->next is written again.
+}
+
+//Take the whole remote free stack of this arena and free the blocks, the caller holds the arena lock.
+void remote_free_drain(){
+    if (__atomic_load_n(&arena->remote_free_head, __ATOMIC_RELAXED) == NULL){
+        return;
+    }
+    mini_node_t* remote_block = __atomic_exchange_n(&arena->remote_free_head, NULL, __ATOMIC_ACQUIRE);
+    while (remote_block != NULL){
+        mini_node_t* next_remote_block = remote_block->next;
+        arena_free(remote_block);
+        remote_block = next_remote_block;
+    }
+}
+
+//free in the arena that owns ptr, with its lock if it is the arena of this thread, otherwise to its remote free stack.
+void free_to_arena(void* ptr){
+    arena_t* thread_arena = arena;
+    arena_t* owner_arena = get_block_arena(ptr);
+    if (ARENA_NUM > 1 && owner_arena != thread_arena){
+        remote_free_push(owner_arena, (mini_node_t*)ptr, (mini_node_t*)ptr);
+        return;
+        //The owner's lock may be busy with its own malloc, it will free the block later.
+    }
+    lock_arena(owner_arena);
+    arena = owner_arena;
+    arena_free(ptr);
+    arena = thread_arena;
+    unlock_arena(owner_arena);
+    //The block goes back to the arena it came from, even when another thread frees it.
+}
+
+//Give all blocks of one bin back to their arenas, blocks of this thread's arena are freed under one lock,
+//each run of blocks from another arena goes to its remote free stack with one push.
+void tcache_flush_bin(tcache_t* thread_cache, int bin_index){
+    arena_t* thread_arena = arena;
+    bool locked = false;
+    mini_node_t* cached_block = thread_cache->heads[bin_index];
+    thread_cache->heads[bin_index] = NULL;
+    thread_cache->counts[bin_index] = 0;
+    //Take the bin out first, so the heap checker in free does not see half freed bin.
+    while (cached_block != NULL){
+        arena_t* owner_arena = get_block_arena(cached_block);
+        mini_node_t* last_block = cached_block;
+        while (last_block->next != NULL && get_block_arena(last_block->next) == owner_arena){
+            last_block = last_block->next;
+        }
+        mini_node_t* next_run = last_block->next;
+        if (ARENA_NUM > 1 && owner_arena != thread_arena){
+            remote_free_push(owner_arena, cached_block, last_block);
+            cached_block = next_run;
+            continue;
+        }
+        if (!locked){
+            lock_arena(thread_arena);
+            locked = true;
+        }
+        while (cached_block != next_run){
+            mini_node_t* next_cached_block = cached_block->next;
+            arena_free(cached_block);
+            cached_block = next_cached_block;
+        }
+    }
+    if (locked){
+        unlock_arena(thread_arena);
+    }
+}
+
+//Free the blocks of this thread's cache that belong to the arena we hold the lock of, true if any.
+//malloc calls it before growing the heap, blocks of other arenas stay because their lock is not held.
+bool tcache_flush_arena_blocks(){
+    bool flushed = false;
+    for (int i = 0; i < tcache_bin_num; i++){
+        mini_node_t** link = &tcache->heads[i];
+        while (*link != NULL){
+            mini_node_t* cached_block = *link;
+            if (get_block_arena(cached_block) != arena){
+                link = &cached_block->next;
+                continue;
+            }
+            *link = cached_block->next;
+            tcache->counts[i]--;
+            arena_free(cached_block);
+            flushed = true;
+        }
+    }
+    return flushed;
+}
+
+//pthread key destructor, the thread is exiting so all its cached blocks and the cache go back.
+void tcache_destroy(void* thread_cache){
+    for (int i = 0; i < tcache_bin_num; i++){
+        tcache_flush_bin((tcache_t*)thread_cache, i);
+    }
+    tcache = NULL;
+    free_to_arena(thread_cache);
+}
+
+void tcache_key_create(){
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+//The cache of this thread, made on the first free of the thread.
+tcache_t* get_thread_tcache(){
+    if (tcache != NULL){
+        return tcache;
+    }
+    arena_t* thread_arena = get_thread_arena();
+    if (thread_arena == NULL){
+        return NULL;
+    }
+    lock_arena(thread_arena);
+    tcache_t* new_tcache = (tcache_t*)arena_malloc(sizeof(tcache_t));
+    unlock_arena(thread_arena);
+    if (new_tcache == NULL){
+        return NULL;
+    }
+    for (int i = 0; i < tcache_bin_num; i++){
+        new_tcache->heads[i] = NULL;
+        new_tcache->counts[i] = 0;
+    }
+    pthread_once(&tcache_key_once, tcache_key_create);
+    pthread_setspecific(tcache_key, new_tcache);
+    tcache = new_tcache;
+    return tcache;
+}
+
+//Put the block in the thread cache, false if it is too large or there is no cache.
+bool tcache_push(void* ptr){
+    uint64_t size = get_total_block_size((uint64_t*)ptr - 1);
+    if (size > tcache_max_block_size){
+        return false;
+    }
+    tcache_t* thread_cache = get_thread_tcache();
+    if (thread_cache == NULL){
+        return false;
+    }
+    int bin_index = tcache_bin_index(size);
+    uint32_t bin_limit = TCACHE_COUNT;
+    if (thread_cache->counts[bin_index] >= bin_limit){
+        tcache_flush_bin(thread_cache, bin_index);
+    }
+    mini_node_t* cached_block = (mini_node_t*)ptr;
+    cached_block->next = thread_cache->heads[bin_index];
+    thread_cache->heads[bin_index] = cached_block;
+    thread_cache->counts[bin_index]++;
+    return true;
+}
+
+#if percpu_enabled
+//The rseq area glibc registered for this thread, NULL if there is none (old kernel, or turned off by a glibc tunable).
+struct rseq* get_thread_rseq(){
+    if (__rseq_size == 0){
+        return NULL;
+    }
+    struct rseq* rseq_area = (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+    if ((int32_t)rseq_area->cpu_id < 0){
+        return NULL;
+    }
+    return rseq_area;
+}
+
+//Push ptr to the bin of cpu as a restartable sequence. From label 1 to the top store at label 2 the kernel sends the
+//thread to the abort label (after the RSEQ_SIG) if it is preempted, gets a signal or moves to another CPU,
+//so nobody else touched the bin in between and the plain stores are safe.
+//Return 1 when pushed, 0 when the bin is full, -1 when it was aborted and must be tried again.
+//top is an in/out operand (asm goto with outputs needs GCC 11 or clang 11), the "memory" clobber is for the slot
+//and the rseq_cs field, which are written through registers.
+int percpu_push(struct rseq* rseq_area, uint32_t cpu, percpu_bin_t* bin, void* ptr){
+    asm goto (
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0x0, 0x0\n\t"
+        ".quad 1f, (2f - 1f), 4f\n\t"
+        ".popsection\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %c[rseq_cs_offset](%[rseq_area])\n\t"
+        "1:\n\t"
+        "cmpl %[cpu], %c[cpu_id_offset](%[rseq_area])\n\t"
+        "jnz %l[aborted]\n\t"
+        "movq %[top], %%rcx\n\t"
+        "cmpq %[slot_num], %%rcx\n\t"
+        "jae %l[full]\n\t"
+        "movq %[ptr], (%[slots], %%rcx, 8)\n\t"
+        "incq %%rcx\n\t"
+        "movq %%rcx, %[top]\n\t"
+        "2:\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long 0x53053053\n\t"
+        "4:\n\t"
+        "jmp %l[aborted]\n\t"
+        ".popsection\n\t"
+        : [top] "+m" (bin->top)
+        : [rseq_area] "r" (rseq_area), [cpu] "r" (cpu), [slots] "r" (bin->slots), [ptr] "r" (ptr),
+          [slot_num] "i" (percpu_bin_slots), [rseq_cs_offset] "i" (offsetof(struct rseq, rseq_cs)),
+          [cpu_id_offset] "i" (offsetof(struct rseq, cpu_id))
+        : "rax", "rcx", "memory", "cc"
+        : aborted, full);
+    return 1;
+aborted:
+    return -1;
+full:
+    return 0;
+}
+
+//Pop the top block of the bin of cpu to *popped, the same restartable sequence as percpu_push.
+//Return 1 when popped, 0 when the bin is empty, -1 when it was aborted and must be tried again.
+//Same operands as percpu_push, the "memory" clobber covers the store to *popped.
+int percpu_pop(struct rseq* rseq_area, uint32_t cpu, percpu_bin_t* bin, void** popped){
+    asm goto (
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0x0, 0x0\n\t"
+        ".quad 1f, (2f - 1f), 4f\n\t"
+        ".popsection\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %c[rseq_cs_offset](%[rseq_area])\n\t"
+        "1:\n\t"
+        "cmpl %[cpu], %c[cpu_id_offset](%[rseq_area])\n\t"
+        "jnz %l[aborted]\n\t"
+        "movq %[top], %%rcx\n\t"
+        "testq %%rcx, %%rcx\n\t"
+        "jz %l[empty]\n\t"
+        "movq -8(%[slots], %%rcx, 8), %%rax\n\t"
+        "movq %%rax, (%[popped])\n\t"
+        "decq %%rcx\n\t"
+        "movq %%rcx, %[top]\n\t"
+        "2:\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long 0x53053053\n\t"
+        "4:\n\t"
+        "jmp %l[aborted]\n\t"
+        ".popsection\n\t"
+        : [top] "+m" (bin->top)
+        : [rseq_area] "r" (rseq_area), [cpu] "r" (cpu), [slots] "r" (bin->slots), [popped] "r" (popped),
+          [rseq_cs_offset] "i" (offsetof(struct rseq, rseq_cs)), [cpu_id_offset] "i" (offsetof(struct rseq, cpu_id))
+        : "rax", "rcx", "memory", "cc"
+        : aborted, empty);
+    return 1;
+aborted:
+    return -1;
+empty:
+    return 0;
+}
+
+//The cache of cpu, made from the arena of this thread on the first use of the CPU.
+percpu_cache_t* get_cpu_cache(uint32_t cpu){
+    percpu_cache_t* cpu_cache = __atomic_load_n(&percpu_table[cpu], __ATOMIC_ACQUIRE);
+    if (cpu_cache != NULL){
+        return cpu_cache;
+    }
+    arena_t* thread_arena = get_thread_arena();
+    if (thread_arena == NULL){
+        return NULL;
+    }
+    lock_arena(thread_arena);
+    cpu_cache = (percpu_cache_t*)arena_malloc(sizeof(percpu_cache_t));
+    unlock_arena(thread_arena);
+    if (cpu_cache == NULL){
+        return NULL;
+    }
+    for (int i = 0; i < tcache_bin_num; i++){
+        cpu_cache->bins[i].top = 0;
+    }
+    percpu_cache_t* no_cache = NULL;
+    if (!__atomic_compare_exchange_n(&percpu_table[cpu], &no_cache, cpu_cache, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+        free_to_arena(cpu_cache);
+        cpu_cache = no_cache;
+        //Another thread on this CPU made it first.
+    }
+    return cpu_cache;
+}
+
+//Push or pop one block of the bin bin_index on the CPU this thread runs on, it tries again on the new CPU after an abort.
+//*ptr is the block to push, or gets the popped block. Return false when the bin is full / empty or there is no cache.
+bool percpu_cache_access(int bin_index, void** ptr, bool push){
+    struct rseq* rseq_area = get_thread_rseq();
+    while (rseq_area != NULL){
+        uint32_t cpu = __atomic_load_n(&rseq_area->cpu_id_start, __ATOMIC_RELAXED);
+        if (cpu >= percpu_cpu_num){
+            return false;
         }
+        percpu_cache_t* cpu_cache = push ? get_cpu_cache(cpu) : __atomic_load_n(&percpu_table[cpu], __ATOMIC_ACQUIRE);
+        if (cpu_cache == NULL){
+            return false;
+        }
+        //Only push makes the cache, pop may run with the arena locked (before growing the heap).
+        int result = push ? percpu_push(rseq_area, cpu, &cpu_cache->bins[bin_index], *ptr)
+                          : percpu_pop(rseq_area, cpu, &cpu_cache->bins[bin_index], ptr);
+        if (result >= 0){
+            return result == 1;
+        }
+    }
+    return false;
+}
+#endif
+
+//Is the per-CPU cache in use for this thread, otherwise the thread cache is the fallback.
+bool percpu_available(){
+#if percpu_enabled
+    return percpu_table != NULL && get_thread_rseq() != NULL;
+#else
+    return false;
+#endif
+}
+
+//Put the block in the cache of this CPU, false if it is too large or the bin is full.
+bool percpu_cache_push(void* ptr){
+#if percpu_enabled
+    uint64_t size = get_total_block_size((uint64_t*)ptr - 1);
+    return size <= tcache_max_block_size && percpu_cache_access(tcache_bin_index(size), &ptr, true);
+#else
+    return false;
+#endif
+}
+
+//A cached block of total_block_size from the cache of this CPU, NULL if its bin is empty.
+void* percpu_cache_pop(uint64_t total_block_size){
+#if percpu_enabled
+    void* ptr = NULL;
+    if (total_block_size <= tcache_max_block_size && percpu_cache_access(tcache_bin_index(total_block_size), &ptr, false)){
+        return ptr;
     }
+#endif
     return NULL;
 }
 
+//Empty the cache of this CPU before the locked arena grows the heap, its own blocks are freed, the others go to
+//their arenas' remote free stacks. Blocks of other CPUs stay, their threads may be using them.
+//Returns whether any block was freed to this arena.
+bool percpu_flush_cpu_blocks(){
+    bool flushed = false;
+#if percpu_enabled
+    for (int i = 0; i < tcache_bin_num; i++){
+        void* ptr;
+        while (percpu_cache_access(i, &ptr, false)){
+            if (get_block_arena(ptr) == arena){
+                arena_free(ptr);
+                flushed = true;
+            }
+            else{
+                remote_free_push(get_block_arena(ptr), (mini_node_t*)ptr, (mini_node_t*)ptr);
+            }
+        }
+    }
+#endif
+    return flushed;
+}
 
+//Is ptr the payload of a block from map_large_block, a slab slot has no header to read.
+bool is_mapped_block(void* ptr){
+    if (SLAB && get_slab_run(ptr) != NULL){
+        return false;
+    }
+    return (*get_header_ptr((uint64_t*)ptr) & mapped_bit) != 0;
+}
+
+//A large block with pages of its own: [8 bytes padding + header + payload] rounded up to whole pages,
+//the padding makes the payload 16 bytes aligned. The header size is the whole mapping.
+uint64_t get_mapped_block_size(size_t size){
+    uint64_t page_size = mm_pagesize();
+    return ((uint64_t)size + header_size * 2 + page_size - 1) & ~(page_size - 1);
+}
+
+void* map_large_block(size_t size){
+    uint64_t map_size = get_mapped_block_size(size);
+    if (map_size < size){
+        return NULL;
+    }
+    lock_heap();
+    void* mapping = mm_map(map_size);
+    unlock_heap();
+    if (mapping == (void*) -1){
+        return NULL;
+    }
+    uint64_t* block_ptr = (uint64_t*)mapping + 1;
+    put(block_ptr, pack(map_size, alloc_bit | mapped_bit));
+    return get_payload_ptr(block_ptr);
+}
+
+//Resize a mapped block with mm_remap, it grows in place or its pages move, the bytes are never copied.
+//NULL if it can not grow, then the old block is not changed.
+void* remap_large_block(void* ptr, size_t size){
+    uint64_t* block_ptr = get_header_ptr((uint64_t*)ptr);
+    uint64_t map_size = get_mapped_block_size(size);
+    if (map_size < size){
+        return NULL;
+    }
+    lock_heap();
+    void* mapping = mm_remap(block_ptr - 1, get_total_block_size(block_ptr), map_size);
+    unlock_heap();
+    if (mapping == (void*) -1){
+        return NULL;
+    }
+    block_ptr = (uint64_t*)mapping + 1;
+    put(block_ptr, pack(map_size, alloc_bit | mapped_bit));
+    return get_payload_ptr(block_ptr);
+}
+
+//Give the pages of a mapped block back right away.
+void unmap_large_block(void* ptr){
+    uint64_t* block_ptr = get_header_ptr((uint64_t*)ptr);
+    lock_heap();
+    mm_unmap(block_ptr - 1, get_total_block_size(block_ptr));
+    unlock_heap();
+}
 
 /*
  * malloc
  */
 void* malloc(size_t size)
 {
-    // IMPLEMENT THIS FROM HINT
-    if (size == 0){return NULL;}
-    if (size>=16){size = size;}else{size = 16;}
-    // Check the valid and minimum size, min size is 32, payload minimum is 16.
+    size_t map_threshold = MMAP_THRESHOLD;
+    if (map_threshold > 0 && size >= map_threshold){
+        return map_large_block(size);
+    }
+    if (percpu_enabled && size != 0 && percpu_available()){
+        void* cached_block = percpu_cache_pop(get_aligned_block_size(size));
+        if (cached_block != NULL){
+            return cached_block;
+        }
+        //Same as the thread cache, but shared by the threads of this CPU.
+    }
+    if (tcache_enabled && tcache != NULL && size != 0){
+        uint64_t total_block_size = get_aligned_block_size(size);
+        if (total_block_size <= tcache_max_block_size){
+            int bin_index = tcache_bin_index(total_block_size);
+            mini_node_t* cached_block = tcache->heads[bin_index];
+            if (cached_block != NULL){
+                tcache->heads[bin_index] = cached_block->next;
+                tcache->counts[bin_index]--;
+                return cached_block;
+            }
+        }
+        //Same thread, same size: no lock, the block is still allocated and has the exact size.
+    }
+    arena_t* thread_arena = get_thread_arena();
+    if (thread_arena == NULL){
+        return NULL;
+    }
+    lock_arena(thread_arena);
+    void* ptr = arena_malloc(size);
+    unlock_arena(thread_arena);
+    return ptr;
+}
 
-    uint64_t total_block_size =(uint64_t)align(size+header_size+footer_size);     
-    uint64_t* current_ptr;
+//How far the block must move so its payload is aligned, the padding must be large enough to be a free block by itself.
+uint64_t get_aligned_padding_size(uint64_t* block_ptr, uint64_t alignment){
+    uint64_t padding_size = (-(uintptr_t)get_payload_ptr(block_ptr)) & (alignment - 1);
+    if (padding_size != 0 && padding_size < min_block_size){
+        padding_size += alignment;
+    }
+    return padding_size;
+}
+
+//Allocate a block of block_size whose payload is aligned to alignment (power of 2 and multiple of 16).
+//A free block from the free list must be large enough for the worst padding, but at the end of heap
+//the padding is known, so expand_heap only asks for what is needed.
+//The padding before the aligned block goes back to free list, and split_and_allocate_block gives back the tail.
+uint64_t* allocate_aligned_block(uint64_t block_size, uint64_t alignment){
+    uint64_t* block_ptr;
+    node_t* find_ptr = find_firstfit_in_free_list(block_size + alignment + min_block_size);
+    if (find_ptr != NULL){
+        remove_from_freelist((uint64_t*)find_ptr,get_total_block_size(get_header_ptr((uint64_t*)find_ptr)));
+        block_ptr = get_header_ptr((uint64_t*)find_ptr);
+    }
+    else{
+        block_ptr = expand_heap(get_aligned_padding_size(get_heap_tail_block(), alignment) + block_size);
+        if (block_ptr != NULL && get_aligned_padding_size(block_ptr, alignment) + block_size > get_total_block_size(block_ptr)){
+            add_to_freelist(get_payload_ptr(block_ptr), get_total_block_size(block_ptr));
+            block_ptr = expand_heap(block_size + alignment + min_block_size);
+        }
+        //expand_heap started a new chunk after another arena, so the padding from the old tail was wrong.
+        //Give the block back and ask for the worst padding, which fits wherever the block starts.
+        if (block_ptr == NULL){
+            return NULL;
+        }
+    }
+    uint64_t padding_size = get_aligned_padding_size(block_ptr, alignment);
+    if (padding_size > 0){
+        uint64_t* aligned_block_ptr = (uint64_t*)((char*)block_ptr + padding_size);
+        uint64_t rest_size = get_total_block_size(block_ptr) - padding_size;
+        put(aligned_block_ptr, 0);
+        put_header_footer(block_ptr, padding_size, 0);
+        set_next_prev_alloc(block_ptr, 0);
+        put_header_footer(aligned_block_ptr, rest_size, 0);
+        add_to_freelist(get_payload_ptr(block_ptr), padding_size);
+        block_ptr = aligned_block_ptr;
+        //The block before the free block we got is allocated, so the padding does not need merge.
+    }
+    return split_and_allocate_block(block_ptr, block_size);
+}
+
+// Idea from textbook chapter 9.
+
+uint64_t* merge(uint64_t* block_ptr){
+    uint64_t* prev_block_footer = (uint64_t*)((char*)block_ptr - footer_size);
+    uint64_t* prev_block_header = NULL;
+    uint64_t prev_block_size = 0;
+    uint64_t* next_block_header = get_next_block(block_ptr);
+    uint64_t prev_status;
+    uint64_t next_status = is_block_allocated(next_block_header);
+    if (FOOTERLESS){
+        prev_status = is_prev_block_allocated(block_ptr);
+        //Allocated prev block has no footer, so only read the footer when prev block is free.
+    }
+    else{
+        prev_status = is_block_allocated(prev_block_footer);
+    }
+    if (prev_status == 0){
+        if (FOOTERLESS && is_prev_block_mini(block_ptr)){
+            prev_block_size = mini_block_size;
+            //Free mini block has no footer either, but we know it is 16 bytes.
+        }
+        else{
+            prev_block_size = get_total_block_size(prev_block_footer);
+        }
+        prev_block_header = (uint64_t*)((char*)block_ptr - prev_block_size);
+    }
+    uint64_t total_size = get_total_block_size(block_ptr);
+
+    if (prev_status == 1 && next_status == 1){
+        add_to_freelist(get_payload_ptr(block_ptr),get_total_block_size(block_ptr));
+        return block_ptr;
+    }
+    else if(prev_status == 1 && next_status == 0){
+        remove_from_freelist(get_payload_ptr(next_block_header),get_total_block_size(next_block_header));
+
+        total_size += get_total_block_size(next_block_header);
+        put_header(block_ptr,total_size,0);
+        put((uint64_t*)((char*)get_next_block(block_ptr) - footer_size),pack(total_size,0));
+
+        add_to_freelist(get_payload_ptr(block_ptr),get_total_block_size(block_ptr));
+        //|-curr header--payload--footer-|-next header--payload--footer-|
+        //|------------Merge1------------|------------Merge2------------| 
+        //Total size is the total size of 2 free block will be merged here.
+        //first put changed current block header size and its status
+        //second put, because we already changed the whole merge block header, so we can use this approach to get the pointer to footer's beginning.
+    }
+    else if(prev_status == 0 && next_status == 1){
+        remove_from_freelist(get_payload_ptr(prev_block_header),prev_block_size);
+
+        total_size += prev_block_size;
+        put((uint64_t*)((char*)get_next_block(block_ptr) - footer_size),pack(total_size,0));
+        put_header(prev_block_header,total_size,0);
+        //|-prev header--payload--footer-|-curr header--payload--footer-|
+        //|                              |                              |
+        //|                              here is block_ptr              here is get_next_block(block_ptr)
+        //here is prev_block_header = block_ptr - prev_block_size
+        block_ptr = prev_block_header;
+
+        add_to_freelist(get_payload_ptr(block_ptr),total_size);
+    }
+    else{
+        remove_from_freelist(get_payload_ptr(next_block_header),get_total_block_size(next_block_header));
+        remove_from_freelist(get_payload_ptr(prev_block_header),prev_block_size);
+
+        total_size += prev_block_size + get_total_block_size(next_block_header);
+
+        put_header(prev_block_header,total_size,0); //put whole merge block header its size and its status to merge 1 header 
+
+        uint64_t* next_footer = (uint64_t*)((char*)prev_block_header + get_total_block_size(prev_block_header) - footer_size);
+        put(next_footer,pack(total_size,0)); //put whole merge block header its size and its status to merge 3 footer
+
+        //|-prev header--payload--footer-|-curr header--payload--footer-|-next header--payload--footer-|
+        //|------------Merge1------------|------------Merge2------------|------------Merge3------------|  
+
+        block_ptr = prev_block_header;
+
+        add_to_freelist(get_payload_ptr(block_ptr),get_total_block_size(block_ptr));
+    }
+    set_next_prev_alloc(block_ptr,0);
+    //The merged block is at least 32 bytes, so the block after it should not think its prev is mini anymore.
+    return block_ptr;
+}
+
+//Free one block from the quick list for real: mark it free, tell the next block and merge.
+void quick_list_flush(int quick_index){
+    mini_node_t* quick_block = arena->small_control->quick_heads[quick_index];
+    while (quick_block != NULL){
+        mini_node_t* next_quick_block = quick_block->next;
+        uint64_t* block_ptr = get_header_ptr((uint64_t*)quick_block);
+        put_header_footer(block_ptr, get_total_block_size(block_ptr), 0);
+        set_next_prev_alloc(block_ptr, 0);
+        merge(block_ptr);
+        quick_block = next_quick_block;
+    }
+    arena->small_control->quick_heads[quick_index] = NULL;
+    arena->small_control->quick_counts[quick_index] = 0;
+    arena->small_control->quick_bitmap &= ~((uint32_t)1 << quick_index);
+}
+
+void quick_list_flush_all(){
+    while (arena->small_control->quick_bitmap != 0){
+        quick_list_flush(__builtin_ctz(arena->small_control->quick_bitmap));
+    }
+}
+
+//Push the block to the quick list of its size, the whole list gets merged when it is too long.
+void quick_list_push(uint64_t* block_ptr, uint64_t size){
+    int quick_index = quick_list_index(size);
+    mini_node_t* quick_block = (mini_node_t*)get_payload_ptr(block_ptr);
+    quick_block->next = arena->small_control->quick_heads[quick_index];
+    arena->small_control->quick_heads[quick_index] = quick_block;
+    arena->small_control->quick_bitmap |= (uint32_t)1 << quick_index;
+    if (++arena->small_control->quick_counts[quick_index] > QUICK_LIST_LIMIT){
+        quick_list_flush(quick_index);
+    }
+}
+
+//Which run the payload ptr is in, NULL if it is not a slab slot.
+slab_run_t* get_slab_run(void* ptr){
+    uint64_t page = (uint64_t)((char*)ptr - arena->small_control->heap_base) >> slab_run_log2;
+    if (page >= arena->small_control->run_map_pages || ((arena->small_control->run_map[page / 64] >> (page % 64)) & 1) == 0){
+        return NULL;
+    }
+    return (slab_run_t*)(arena->small_control->heap_base + (page << slab_run_log2));
+}
+
+//Set or clear the run map bit of this run. The map is a normal allocated block,
+//when the heap gets beyond it, a 2 times larger one is malloc-ed and the old one is freed.
+bool run_map_set(slab_run_t* run, bool is_run){
+    uint64_t page = (uint64_t)((char*)run - arena->small_control->heap_base) >> slab_run_log2;
+    if (page >= arena->small_control->run_map_pages){
+        uint64_t new_pages = arena->small_control->run_map_pages * 2;
+        if (new_pages < slab_run_size){
+            new_pages = slab_run_size;
+        }
+        while (page >= new_pages){
+            new_pages *= 2;
+        }
+        uint64_t* new_map = arena_malloc(new_pages / 8);    //At least 512 bytes, so it does not come from a slab run.
+        if (new_map == NULL){
+            return false;
+        }
+        for (uint64_t i = 0; i < new_pages / 64; i++){
+            new_map[i] = (i < arena->small_control->run_map_pages / 64) ? arena->small_control->run_map[i] : 0;
+        }
+        uint64_t* old_map = arena->small_control->run_map;
+        arena->small_control->run_map = new_map;
+        arena->small_control->run_map_pages = new_pages;
+        arena_free(old_map);
+    }
+    if (is_run){
+        arena->small_control->run_map[page / 64] |= (uint64_t)1 << (page % 64);
+    }
+    else{
+        arena->small_control->run_map[page / 64] &= ~((uint64_t)1 << (page % 64));
+    }
+    return true;
+}
+
+//Get a new page aligned run for the class and put it in the list of runs with free slots.
+slab_run_t* slab_new_run(int class_index){
+    uint64_t run_block_size = align(slab_run_size + alloc_overhead);
+    uint64_t* run_block = allocate_aligned_block(run_block_size, slab_run_size);
+    if (run_block == NULL){
+        return NULL;
+    }
+    slab_run_t* run = (slab_run_t*)get_payload_ptr(run_block);
+    if (!run_map_set(run, true)){
+        arena_free(run);
+        return NULL;
+    }
+    run->slot_size = (class_index + 1) * 16;
+    run->slot_count = (slab_run_size - slab_run_header_size) / run->slot_size;
+    run->free_count = run->slot_count;
+    run->class_index = class_index;
+    for (uint32_t i = 0; i < slab_bitmap_words; i++){
+        if (run->slot_count >= (i + 1) * 64){
+            run->free_bitmap[i] = ~(uint64_t)0;
+        }
+        else if (run->slot_count > i * 64){
+            run->free_bitmap[i] = ((uint64_t)1 << (run->slot_count - i * 64)) - 1;
+        }
+        else{
+            run->free_bitmap[i] = 0;
+        }
+    }
+    //Only the first slot_count bits are slots.
+    run->prev = NULL;
+    run->next = NULL;
+    arena->small_control->slab_heads[class_index] = run;
+    return run;
+}
+
+void slab_remove_run(slab_run_t* run){
+    if (run->prev != NULL){
+        run->prev->next = run->next;
+    }
+    else{
+        arena->small_control->slab_heads[run->class_index] = run->next;
+    }
+    if (run->next != NULL){
+        run->next->prev = run->prev;
+    }
+}
+
+//Take the first free slot of the first run with free slots, a full run leaves the list.
+void* slab_malloc(size_t size){
+    int class_index = (int)(align(size) / 16) - 1;
+    slab_run_t* run = arena->small_control->slab_heads[class_index];
+    if (run == NULL){
+        run = slab_new_run(class_index);
+        if (run == NULL){
+            return NULL;
+        }
+    }
+    int word = 0;
+    while (run->free_bitmap[word] == 0){
+        word++;
+    }
+    int bit = __builtin_ctzll(run->free_bitmap[word]);
+    run->free_bitmap[word] &= ~((uint64_t)1 << bit);
+    if (--run->free_count == 0){
+        slab_remove_run(run);
+    }
+    return (char*)run + slab_run_header_size + (uint64_t)(word * 64 + bit) * run->slot_size;
+}
 
-    // Explicit find fit and allocate:
-    node_t* find_ptr = find_firstfit_in_free_list(total_block_size);
-    if (find_ptr == NULL){
-        current_ptr = expand_heap(total_block_size);
-        //dbg_printf("1malloc1 size %ld and aligned size is %ld at %p\n", size, total_block_size, current_ptr);
-        uint64_t* after_allocated_current_ptr = split_and_allocate_block(current_ptr,total_block_size);
-        return get_payload_ptr(after_allocated_current_ptr);
+//Give the slot back. A full run comes back to the list, an empty run goes back to the heap,
+//unless it is the only run of its class with free slots, so one malloc/free pair does not get a new run every time.
+void slab_free(slab_run_t* run, void* ptr){
+    uint64_t slot = (uint64_t)((char*)ptr - (char*)run - slab_run_header_size) / run->slot_size;
+    run->free_bitmap[slot / 64] |= (uint64_t)1 << (slot % 64);
+    if (run->free_count++ == 0){
+        run->prev = NULL;
+        run->next = arena->small_control->slab_heads[run->class_index];
+        if (run->next != NULL){
+            run->next->prev = run;
+        }
+        arena->small_control->slab_heads[run->class_index] = run;
     }
-    else{
-        //dbg_printf("2found in freelist malloc size %ld and aligned size is %ld at %p\n", size, total_block_size, get_header_ptr((uint64_t*)find_ptr));
-        //dbg_printf("2Freelist_head store at %p and next is %p, prev is %p\n", find_ptr, freelist_heads[go_which_range_freelist(total_block_size)]->next, freelist_heads[go_which_range_freelist(total_block_size)]->prev);
-        remove_from_freelist((uint64_t*)find_ptr,get_total_block_size(get_header_ptr((uint64_t*)find_ptr)));
-        //dbg_printf("2malloc size %ld and aligned size is %ld at %p\n", size, total_block_size, get_header_ptr((uint64_t*)find_ptr));
-        uint64_t* after_allocated_current_ptr = split_and_allocate_block(get_header_ptr((uint64_t*)find_ptr),total_block_size);
-        return get_payload_ptr(after_allocated_current_ptr);
+    else if (run->free_count == run->slot_count && (run->prev != NULL || run->next != NULL)){
+        slab_remove_run(run);
+        run_map_set(run, false);
+        uint64_t* run_block = get_header_ptr((uint64_t*)run);
+        put_header_footer(run_block, get_total_block_size(run_block), 0);
+        set_next_prev_alloc(run_block, 0);
+        merge(run_block);
     }
 }
 
-// Idea from textbook chapter 9.
+//free in the arena that owns ptr, the caller holds its lock and switched arena to it.
+void arena_free(void* ptr)
+{
+    // IMPLEMENT THIS
+    if (ptr == NULL){
+        return;
+    }
+    decay_tick();
+    if (SLAB){
+        slab_run_t* run = get_slab_run(ptr);
+        if (run != NULL){
+            slab_free(run, ptr);
+            mm_checkheap(__LINE__);
+            return;
+        }
+        //Slab slot has no header, so check the run map before reading one.
+    }
+    uint64_t* block_ptr = (uint64_t*) ptr - 1;  //Get block_ptr point to block beginning;
 
-uint64_t* merge(uint64_t* block_ptr){
-    uint64_t* prev_block_footer = (uint64_t*)((char*)block_ptr - footer_size);
-    uint64_t* prev_block_header = (uint64_t*)((char*)block_ptr - get_total_block_size(prev_block_footer));
-    uint64_t* next_block_header = get_next_block(block_ptr);
-    uint64_t prev_status = is_block_allocated(prev_block_footer);
-    uint64_t next_status = is_block_allocated(next_block_header);
-    uint64_t total_size = get_total_block_size(block_ptr);
+    //dbg_printf("3free payload at %p and header at %p\n", ptr, block_ptr);
 
-    if (prev_status == 1 && next_status == 1){
-        add_to_freelist(get_payload_ptr(block_ptr),get_total_block_size(block_ptr));
-        return block_ptr;
+    uint64_t whole_size = get_total_block_size(block_ptr);
+    if (QUICK_LIST_LIMIT > 0 && whole_size <= quick_max_block_size){
+        quick_list_push(block_ptr, whole_size);
+        mm_checkheap(__LINE__);
+        return;
+        //Small block skips the merge, it waits in the quick list for the next malloc of the same size.
     }
-    else if(prev_status == 1 && next_status == 0){
-        remove_from_freelist(get_payload_ptr(next_block_header),get_total_block_size(next_block_header));
-
-        total_size += get_total_block_size(next_block_header);
-        put(block_ptr,pack(total_size,0));
-        put((uint64_t*)((char*)get_next_block(block_ptr) - footer_size),pack(total_size,0));
+    put_header_footer(block_ptr,whole_size,0);
+    set_next_prev_alloc(block_ptr,0);
+    //Free block header and footer setting, and tell next block this one is free now.
 
-        add_to_freelist(get_payload_ptr(block_ptr),get_total_block_size(block_ptr));
-        //|-curr header--payload--footer-|-next header--payload--footer-|
-        //|------------Merge1------------|------------Merge2------------| 
-        //Total size is the total size of 2 free block will be merged here.
-        //first put changed current block header size and its status
-        //second put, because we already changed the whole merge block header, so we can use this approach to get the pointer to footer's beginning.
+    //dbg_printf("3Freelist store at %p and next is %p, prev is %p\n", ptr, freelist_heads[go_which_range_freelist(whole_size)]->next, freelist_heads[go_which_range_freelist(whole_size)]->prev);
+    block_ptr = merge(block_ptr);
+    if (TRIM_THRESHOLD > 0){
+        trim_heap(block_ptr);
     }
-    else if(prev_status == 0 && next_status == 1){
-        remove_from_freelist(get_payload_ptr(prev_block_header),get_total_block_size(prev_block_header));
 
-        total_size += get_total_block_size(prev_block_footer);
-        put((uint64_t*)((char*)get_next_block(block_ptr) - footer_size),pack(total_size,0));
-        put((uint64_t*)((char*)block_ptr - get_total_block_size(prev_block_footer)),pack(total_size,0));
-        //|-prev header--payload--footer-|-curr header--payload--footer-|
-        //|                              |                              |
-        //|                              here is block_ptr              here is get_next_block(block_ptr)
-        //here is block_ptr - get_total_block_size(prev_block_footer)
-        block_ptr = (uint64_t*)((char*)block_ptr - get_total_block_size(prev_block_footer));
+    mm_checkheap(__LINE__);
+}
 
-        add_to_freelist(get_payload_ptr(block_ptr),total_size);
-    }
-    else{
-        remove_from_freelist(get_payload_ptr(next_block_header),get_total_block_size(next_block_header));
-        remove_from_freelist(get_payload_ptr(prev_block_header),get_total_block_size(prev_block_header));
 
-        total_size += get_total_block_size(prev_block_footer) + get_total_block_size(next_block_header);
+//Shrink the allocated block to new_block_size, the cut off tail becomes a free block and merges with the next block if it is free.
+//The tail must be at least min_block_size.
+void shrink_allocated_block(uint64_t* block_ptr, uint64_t new_block_size){
+    uint64_t tail_size = get_total_block_size(block_ptr) - new_block_size;
+    put_header_footer(block_ptr, new_block_size, 1);
 
-        uint64_t* prev_header = (uint64_t*)((char*)block_ptr - get_total_block_size(prev_block_footer));
-        put(prev_header,pack(total_size,0)); //put whole merge block header its size and its status to merge 1 header 
+    uint64_t* tail_ptr = (uint64_t*)((char*)block_ptr + new_block_size);
+    put(tail_ptr, 0);
+    set_next_prev_alloc(block_ptr, 1);
+    put_header_footer(tail_ptr, tail_size, 0);
+    set_next_prev_alloc(tail_ptr, 0);
+    merge(tail_ptr);
+}
 
-        uint64_t* next_footer = (uint64_t*)((char*)prev_header + get_total_block_size(prev_header) - footer_size);
-        put(next_footer,pack(total_size,0)); //put whole merge block header its size and its status to merge 3 footer
+//Grow the allocated block in place by taking the next block, only when the next block is free and large enough.
+//Return false if it can not, then the block is not changed.
+bool grow_allocated_block_in_place(uint64_t* block_ptr, uint64_t new_block_size){
+    uint64_t* next_block = get_next_block(block_ptr);
+    uint64_t combined_size = get_total_block_size(block_ptr) + get_total_block_size(next_block);
+    if (is_block_allocated(next_block) || combined_size < new_block_size){
+        return false;
+    }
 
-        //|-prev header--payload--footer-|-curr header--payload--footer-|-next header--payload--footer-|
-        //|------------Merge1------------|------------Merge2------------|------------Merge3------------|  
+    remove_from_freelist(get_payload_ptr(next_block), get_total_block_size(next_block));
+    put_header(block_ptr, combined_size, 1);
+    split_and_allocate_block(block_ptr, new_block_size);
+    //Now it is one big allocated block, split_and_allocate_block gives back the extra part to free list.
+    return true;
+}
 
-        block_ptr = (uint64_t*)((char*)block_ptr - get_total_block_size(prev_block_footer));
+//Grow the last block of the heap (maybe with a free block between it and the epilogue) by mm_sbrk only the missing bytes,
+//then move the epilogue, no copy is needed. Return false if the block is not at the end of heap or sbrk fails.
+bool grow_last_block_in_place(uint64_t* block_ptr, uint64_t new_block_size){
+    uint64_t* next_block = get_next_block(block_ptr);
+    uint64_t available_size = get_total_block_size(block_ptr);
+    bool next_is_free = false;
+    if (next_block != arena->heap_epi){
+        if (is_block_allocated(next_block) || get_next_block(next_block) != arena->heap_epi){
+            return false;
+        }
+        next_is_free = true;
+        available_size += get_total_block_size(next_block);
+        //|-block-|-free block-|-epilogue-|, the free block is also used.
+    }
 
-        add_to_freelist(get_payload_ptr(block_ptr),get_total_block_size(block_ptr));
+    lock_heap();
+    bool grown = heap_epi_at_brk() && heap_can_grow(new_block_size - available_size)
+                 && mm_sbrk(new_block_size - available_size) != (void*) -1;
+    unlock_heap();
+    if (!grown){
+        return false;
     }
-    return block_ptr;
+    if (next_is_free){
+        remove_from_freelist(get_payload_ptr(next_block), get_total_block_size(next_block));
+    }
+    put_header_footer(block_ptr, new_block_size, 1);
+    arena->heap_epi = (uint64_t*)((char*)block_ptr + new_block_size);
+    *arena->heap_epi = 0x0000000000000000 | 0x0000000000000001;        //Reset the epilogue at the new end of heap.
+    set_next_prev_alloc(block_ptr, 1);
+    return true;
+}
+
+//free of a block in heap (or slab slot), through the per-CPU cache or thread cache when they take it.
+void free_heap_block(void* ptr){
+    if (percpu_enabled && percpu_available()){
+        if (!percpu_cache_push(ptr)){
+            free_to_arena(ptr);
+        }
+        return;
+        //A full bin does not fall back to the thread cache, that would make a cache for this thread.
+    }
+    if (tcache_enabled && tcache_push(ptr)){
+        return;
+    }
+    free_to_arena(ptr);
 }
 
 /*
  * free
  */
-
 void free(void* ptr)
 {
-    // IMPLEMENT THIS
     if (ptr == NULL){
         return;
     }
-    uint64_t* block_ptr = (uint64_t*) ptr - 1;  //Get block_ptr point to block beginning;
-
-    //dbg_printf("3free payload at %p and header at %p\n", ptr, block_ptr);
+    if (MMAP_THRESHOLD > 0 && is_mapped_block(ptr)){
+        unmap_large_block(ptr);
+        return;
+    }
+    free_heap_block(ptr);
+}
 
-    uint64_t whole_size = get_total_block_size(block_ptr);
-    put(block_ptr,pack(whole_size,0));
-    uint64_t payload_size = whole_size - header_size - footer_size;
-    uint64_t* block_footer_ptr = (uint64_t*)((char*)block_ptr + payload_size + header_size); 
-    put(block_footer_ptr,pack(whole_size,0));
-    //Free block header and footer setting.
+//Payload size of an allocated block (or slab slot, or mapped block).
+uint64_t get_payload_size(void* ptr){
+    slab_run_t* run = SLAB ? get_slab_run(ptr) : NULL;
+    if (run != NULL){
+        return run->slot_size;
+    }
+    if (MMAP_THRESHOLD > 0 && is_mapped_block(ptr)){
+        return get_total_block_size((uint64_t*)ptr - 1) - header_size * 2;
+    }
+    return get_total_block_size((uint64_t*)ptr - 1) - alloc_overhead;
+}
 
-    //dbg_printf("3Freelist store at %p and next is %p, prev is %p\n", ptr, freelist_heads[go_which_range_freelist(whole_size)]->next, freelist_heads[go_which_range_freelist(whole_size)]->prev);
-    merge(block_ptr);
+/*
+ * free_sized
+ * size is the size the block was asked with (malloc, realloc or memalign), or up to its malloc_usable_size.
+ * A block can only be mapped if it was asked with at least MMAP_THRESHOLD / 2 bytes (see realloc),
+ * so a smaller block goes to the heap free path without checking mapped_bit.
+ * In DEBUG mode the size is checked against the block.
+ */
+void free_sized(void* ptr, size_t size)
+{
+    if (ptr == NULL){
+        return;
+    }
+    dbg_assert(size <= get_payload_size(ptr));
+    size_t map_threshold = MMAP_THRESHOLD;
+    if (map_threshold > 0 && size >= map_threshold / 2 && is_mapped_block(ptr)){
+        unmap_large_block(ptr);
+        return;
+    }
+    free_heap_block(ptr);
+}
 
-    mm_checkheap(__LINE__);
+/*
+ * malloc_usable_size
+ * How many bytes the block can really hold, the request rounded up to the block size (or slab slot, or pages).
+ * The caller can use all of them without realloc. 0 for NULL.
+ */
+size_t malloc_usable_size(void* ptr)
+{
+    if (ptr == NULL){
+        return 0;
+    }
+    return get_payload_size(ptr);
 }
 
+//Try to resize the block without moving it, the caller holds the lock of the owner arena.
+bool realloc_in_place(void* oldptr, size_t size){
+    if (SLAB && get_slab_run(oldptr) != NULL){
+        return size <= get_payload_size(oldptr);
+        //Slab slot can not grow, it moves to a larger slot or a normal block.
+    }
+
+    uint64_t* blcok_ptr = (uint64_t*) ((char*)oldptr - header_size); //uint64 8bytes
+    uint64_t current_block_size = get_total_block_size(blcok_ptr);
+    uint64_t new_block_size = get_aligned_block_size(size);
+    //because the size info is in header, so get blcok_ptr to header beginning
+
+    if (new_block_size <= current_block_size){
+        if (current_block_size - new_block_size >= min_block_size){
+            shrink_allocated_block(blcok_ptr, new_block_size);
+        }
+        return true;
+    }
+    //if it still fits, no need to move, only give the tail back to free list when it is large enough to be a block.
+
+    if (grow_allocated_block_in_place(blcok_ptr, new_block_size)){
+        return true;
+    }
+    //if the next block is free and large enough, take it and no need to copy.
+
+    return grow_last_block_in_place(blcok_ptr, new_block_size);
+    //if the block is the last one in heap, just expand the heap for the missing bytes.
+}
 
 /*
  * realloc
@@ -503,14 +2584,30 @@ void* realloc(void* oldptr, size_t size)
         return 0;
     }
 
-    uint64_t* blcok_ptr = (uint64_t*) ((char*)oldptr - header_size); //uint64 8bytes
-    uint64_t current_payload_size = get_total_block_size(blcok_ptr) - header_size - footer_size;
-    //because the size info is in header, so get blcok_ptr to header beginning
-
-    if (current_payload_size == size){
+    uint64_t current_payload_size;
+    bool resized;
+    size_t map_threshold = MMAP_THRESHOLD;
+    if (MMAP_THRESHOLD > 0 && is_mapped_block(oldptr)){
+        if (size >= map_threshold / 2){
+            return remap_large_block(oldptr, size);
+        }
+        current_payload_size = get_payload_size(oldptr);
+        resized = false;
+        //It stays mapped while it is still large, a much smaller block moves back to the heap.
+    }
+    else{
+        arena_t* thread_arena = arena;
+        arena_t* owner_arena = get_block_arena(oldptr);
+        lock_arena(owner_arena);
+        arena = owner_arena;
+        current_payload_size = get_payload_size(oldptr);
+        resized = realloc_in_place(oldptr, size);
+        arena = thread_arena;
+        unlock_arena(owner_arena);
+    }
+    if (resized){
         return oldptr;
     }
-    //if equal, no need to move
 
     size_t keep_size;
     if(size > current_payload_size){
@@ -523,7 +2620,7 @@ void* realloc(void* oldptr, size_t size)
     //it's min(new_size, old_size), new size is in parameter of the realloc, and old_size got by get_total_block_size helper func
 
     void* newptr = malloc(size);
-    if(newptr == (void*)-1){
+    if(newptr == NULL){
         return 0;
     }
     mm_memcpy(newptr,oldptr,keep_size);    //move the data, these 2 ptr both pointer to the beginning of payload.
@@ -533,19 +2630,232 @@ void* realloc(void* oldptr, size_t size)
 
 /*
  * calloc
- * This function is not tested by mdriver, and has been implemented for you.
+ * A mapped block is all zero already, and a block from the heap only clears what is not known to be zero
+ * (see arena_calloc). Small blocks may come from a cache, quick list or slab, so they are just cleared.
+ * Returns NULL if nmemb * size overflows.
  */
 void* calloc(size_t nmemb, size_t size)
 {
     void* ptr;
-    size *= nmemb;
-    ptr = malloc(size);
-    if (ptr) {
-        memset(ptr, 0, size);
+    if (__builtin_mul_overflow(nmemb, size, &size)){
+        return NULL;
+    }
+    size_t map_threshold = MMAP_THRESHOLD;
+    if (map_threshold > 0 && size >= map_threshold){
+        return map_large_block(size);
+        //mm_map gives pages that were never used or were given back, they read as zero.
+    }
+    if (get_aligned_block_size(size) <= tcache_max_block_size){
+        ptr = malloc(size);
+        if (ptr) {
+            memset(ptr, 0, size);
+        }
+        return ptr;
     }
+    arena_t* thread_arena = get_thread_arena();
+    if (thread_arena == NULL){
+        return NULL;
+    }
+    lock_arena(thread_arena);
+    ptr = arena_calloc(size);
+    unlock_arena(thread_arena);
     return ptr;
 }
 
+/*
+ * memalign
+ * The payload is aligned to alignment, which must be a power of 2. An alignment of 16 or less is just malloc.
+ * allocate_aligned_block cuts the aligned block out of a free block, the padding before it and the tail after it
+ * go back to the free lists. Aligned blocks always stay in the heap, a mapped block's payload is at a fixed offset.
+ */
+void* memalign(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0){
+        return NULL;
+    }
+    if (alignment <= ALIGNMENT){
+        return malloc(size);
+    }
+    uint64_t block_size = get_aligned_block_size(size);
+    if (size == 0 || block_size < size){
+        return NULL;
+    }
+    arena_t* thread_arena = get_thread_arena();
+    if (thread_arena == NULL){
+        return NULL;
+    }
+    lock_arena(thread_arena);
+    uint64_t* block_ptr = allocate_aligned_block(block_size, alignment);
+    unlock_arena(thread_arena);
+    return block_ptr == NULL ? NULL : get_payload_ptr(block_ptr);
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+//Same as memalign, but alignment must also be a multiple of sizeof(void*), and the error is returned.
+int posix_memalign(void** memptr, size_t alignment, size_t size)
+{
+    if (alignment == 0 || alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0){
+        return EINVAL;
+    }
+    if (size == 0){
+        *memptr = NULL;
+        return 0;
+    }
+    void* ptr = memalign(alignment, size);
+    if (ptr == NULL){
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+//Cut n allocated blocks of block_size one after another from the free block block_ptr (not in free list),
+//which is large enough for all of them. The last one is split like a normal malloc, the rest goes back to free list.
+void carve_blocks(uint64_t* block_ptr, uint64_t block_size, size_t n, void** out){
+    uint64_t rest_size = get_total_block_size(block_ptr);
+    for (size_t i = 0; i + 1 < n; i++){
+        uint64_t* next_block_ptr = (uint64_t*)((char*)block_ptr + block_size);
+        put_header_footer(block_ptr, block_size, 1);
+        put(next_block_ptr, 0);
+        set_next_prev_alloc(block_ptr, 1);
+        out[i] = get_payload_ptr(block_ptr);
+        block_ptr = next_block_ptr;
+        rest_size -= block_size;
+        //The header of the next block only gets its prev bits here, its size is written once after the loop.
+    }
+    put_header_footer(block_ptr, rest_size, 0);
+    out[n - 1] = get_payload_ptr(split_and_allocate_block(block_ptr, block_size));
+}
+
+/*
+ * malloc_batch
+ * n blocks of size bytes into out[], all cut from one free block (or the end of heap) in one pass,
+ * so the free list is searched and split once for the whole batch.
+ * Returns how many blocks it got, only less than n when the memory runs out.
+ * Sizes that malloc serves from a slab or mm_map are done one by one.
+ */
+size_t malloc_batch(size_t size, size_t n, void** out)
+{
+    size_t map_threshold = MMAP_THRESHOLD;
+    uint64_t block_size = get_aligned_block_size(size);
+    size_t count = 0;
+    if (size == 0 || n == 0){
+        return 0;
+    }
+    if ((SLAB && size <= slab_max_size) || (map_threshold > 0 && size >= map_threshold) || block_size < size){
+        while (count < n && (out[count] = malloc(size)) != NULL){
+            count++;
+        }
+        return count;
+    }
+    arena_t* thread_arena = get_thread_arena();
+    if (thread_arena == NULL){
+        return 0;
+    }
+    lock_arena(thread_arena);
+    uint64_t* block_ptr = n <= UINT64_MAX / block_size ? get_free_block(block_size * n) : NULL;
+    if (block_ptr != NULL){
+        carve_blocks(block_ptr, block_size, n, out);
+        count = n;
+    }
+    else{
+        while (count < n && (out[count] = arena_malloc(size)) != NULL){
+            count++;
+        }
+        //The heap can not grow by the whole batch, take what still fits one by one.
+    }
+    mm_checkheap(__LINE__);
+    unlock_arena(thread_arena);
+    return count;
+}
+
+//free_batch marks its blocks in two bits of the header before it frees them, so it finds the runs of
+//blocks next to each other without sorting. Both are cleared again before free_batch returns.
+//bit 3 on an allocated block in heap (mapped_bit is only for mapped blocks): the block is in the batch.
+//bit 56 (above the arena index): the block before this one is in the batch.
+#define batch_free_bit 0x8
+#define batch_prev_free_bit ((uint64_t)1 << 56)
+
+bool is_batch_free_block(uint64_t* block_ptr){
+    return (*block_ptr & (alloc_bit | batch_free_bit)) == (alloc_bit | batch_free_bit);
+}
+
+/*
+ * free_batch
+ * Frees every block in ptrs[] (NULL is skipped), the blocks of this thread's arena that are next to each other
+ * in heap become one free block first, so merge() and the free list run once for each run of blocks,
+ * and the arena is locked once. Mapped blocks, slab slots and blocks of other arenas are freed one by one.
+ * The order of ptrs[] is changed.
+ */
+void free_batch(void** ptrs, size_t n)
+{
+    arena_t* thread_arena = get_thread_arena();
+    if (thread_arena == NULL){
+        return;
+    }
+    lock_arena(thread_arena);
+    size_t batch_count = 0;
+    for (size_t i = 0; i < n; i++){
+        void* ptr = ptrs[i];
+        if (ptr == NULL){
+            continue;
+        }
+        if (MMAP_THRESHOLD > 0 && is_mapped_block(ptr)){
+            unmap_large_block(ptr);
+            continue;
+        }
+        if (get_block_arena(ptr) != thread_arena){
+            free_to_arena(ptr);
+            continue;
+            //Another arena takes it on its remote free stack.
+        }
+        if (SLAB && get_slab_run(ptr) != NULL){
+            arena_free(ptr);
+            continue;
+        }
+        uint64_t* block_ptr = get_header_ptr((uint64_t*)ptr);
+        *block_ptr |= batch_free_bit;
+        *get_next_block(block_ptr) |= batch_prev_free_bit;
+        decay_tick();
+        ptrs[i] = ptrs[batch_count];
+        ptrs[batch_count++] = ptr;
+        //The marked blocks move to the front, the others may already be reused by another thread.
+    }
+    size_t run_count = 0;
+    for (size_t i = 0; i < batch_count; i++){
+        uint64_t* run_ptr = get_header_ptr((uint64_t*)ptrs[i]);
+        if ((*run_ptr & batch_prev_free_bit) != 0){
+            continue;
+            //The first block of the run takes this one.
+        }
+        uint64_t run_size = 0;
+        uint64_t* next_block_ptr;
+        do {
+            run_size += get_total_block_size((uint64_t*)((char*)run_ptr + run_size));
+            next_block_ptr = (uint64_t*)((char*)run_ptr + run_size);
+        } while (is_batch_free_block(next_block_ptr));
+        *next_block_ptr &= ~batch_prev_free_bit;
+        put_header_footer(run_ptr, run_size, 0);
+        set_next_prev_alloc(run_ptr, 0);
+        ptrs[run_count++] = ptrs[i];
+    }
+    //Every run is one free block now, not in free list yet. The headers inside a run are not read again,
+    //merge() below can write its links over them. Two runs are never next to each other, so merge() only meets
+    //free blocks that are in the free list.
+    for (size_t i = 0; i < run_count; i++){
+        uint64_t* run_ptr = merge(get_header_ptr((uint64_t*)ptrs[i]));
+        if (TRIM_THRESHOLD > 0){
+            trim_heap(run_ptr);
+        }
+    }
+    mm_checkheap(__LINE__);
+    unlock_arena(thread_arena);
+}
+
 /*
  * Returns whether the pointer is in the heap.
  * May be useful for debugging.
@@ -565,6 +2875,47 @@ static bool aligned(const void* p)
     return align(ip) == ip;
 }
 
+/*
+ * large_tree_check
+ * Walk the large block tree in order, check the order, the height and balance of every node,
+ * and every node is a free large block in heap. Returns the height, or -1 if something is wrong.
+ */
+static int64_t large_tree_check(large_tree_node_t* node, large_tree_node_t** last_node, uint64_t* heap_free_count, int line_number)
+{
+    if (node == NULL){
+        return 0;
+    }
+    int64_t left_height = large_tree_check(node->left, last_node, heap_free_count, line_number);
+    if (left_height < 0){
+        return -1;
+    }
+    uint64_t* header = get_header_ptr((uint64_t*)node);
+    if (is_block_allocated(header) != 0 || go_which_range_freelist(get_total_block_size(header)) != large_tree_index || in_heap(node) == false){
+        printf("Block in large tree is not a free large block, block at %p in line %d\n",header,line_number);
+        return -1;
+    }
+    if (node->free_epoch > arena->decay_epoch){
+        printf("Large tree node is freed in a future epoch, block at %p in line %d\n",header,line_number);
+        return -1;
+    }
+    if (*last_node != NULL && large_tree_less(node, *last_node)){
+        printf("Large tree is not in order, block at %p in line %d\n",header,line_number);
+        return -1;
+    }
+    *last_node = node;
+    (*heap_free_count)--;
+    int64_t right_height = large_tree_check(node->right, last_node, heap_free_count, line_number);
+    if (right_height < 0){
+        return -1;
+    }
+    int64_t height = 1 + (left_height > right_height ? left_height : right_height);
+    if ((int64_t)node->height != height || left_height - right_height > 1 || right_height - left_height > 1){
+        printf("Large tree height is wrong or not balanced, block at %p in line %d\n",header,line_number);
+        return -1;
+    }
+    return height;
+}
+
 /*
  * mm_checkheap
  * You call the function via mm_checkheap(__LINE__)
@@ -577,42 +2928,94 @@ bool mm_checkheap(int line_number)
     // Write code to check heap invariants here
     // IMPLEMENT THIS
 
-    //heap checker
+    //heap checker, it checks every chunk of this arena, the 8 bytes before a chunk's prelogue links the next chunk.
     uint64_t* checker_ptr;    //Where the heap start
-    for(checker_ptr = heap_pre; get_total_block_size(checker_ptr) > 0; checker_ptr = get_next_block(checker_ptr)){
-        assert(*checker_ptr == *(get_next_block(checker_ptr)- 1));
-        //Checking whole heap that the block header and footer's consistency
+    uint64_t heap_free_count = 0;
+    for (uint64_t* chunk_pre = arena->heap_pre; chunk_pre != NULL; chunk_pre = (uint64_t*)*(chunk_pre - 1)){
+        uint64_t prev_alloc_status = 1;    //The prelogue is always allocated
+        uint64_t prev_mini_status = 0;
+        for(checker_ptr = chunk_pre; get_total_block_size(checker_ptr) > 0; checker_ptr = get_next_block(checker_ptr)){
+            bool has_footer = !FOOTERLESS || checker_ptr == chunk_pre
+                || (is_block_allocated(checker_ptr) == 0 && get_total_block_size(checker_ptr) != mini_block_size);
+            if (has_footer){
+                if (get_total_block_size(checker_ptr) != get_total_block_size(get_footer_ptr(checker_ptr))
+                    || is_block_allocated(checker_ptr) != is_block_allocated(get_footer_ptr(checker_ptr))){
+                    printf("Block header and footer not match, block at %p in line %d\n",checker_ptr,line_number);
+                    return false;
+                }
+            }
+            //Checking whole heap that the block header and footer's consistency, allocated block has no footer in FOOTERLESS mode.
 
-        if (is_block_allocated(checker_ptr) == 0 && is_block_allocated(get_next_block(checker_ptr)) == 0){
-            printf("Block nearby free, but no merge, block at %p in line %d\n",checker_ptr,line_number);
-            return false;
-        }
-        //checking there are no 2 free block not merge.
+            if (checker_ptr != chunk_pre && (*checker_ptr & ((uint64_t)arena_index_mask << arena_index_shift)) != arena->header_bits){
+                printf("Block has the index of another arena, block at %p in line %d\n",checker_ptr,line_number);
+                return false;
+            }
+            //checking the arena index in the header, free() uses it to find the arena.
+
+            if (FOOTERLESS && checker_ptr != chunk_pre
+                && (is_prev_block_allocated(checker_ptr) != prev_alloc_status || is_prev_block_mini(checker_ptr) != prev_mini_status)){
+                printf("Block prev alloc bit or prev mini bit is wrong, block at %p in line %d\n",checker_ptr,line_number);
+                return false;
+            }
+            prev_alloc_status = is_block_allocated(checker_ptr);
+            prev_mini_status = (checker_ptr != chunk_pre && get_total_block_size(checker_ptr) == mini_block_size);
+            //The prelogue is also 16 bytes, but it is always allocated so nobody needs its mini bit.
+            //checking the prev alloc bit and prev mini bit are sync with the real prev block.
+
+            if (is_block_allocated(checker_ptr) == 0 && is_block_allocated(get_next_block(checker_ptr)) == 0){
+                printf("Block nearby free, but no merge, block at %p in line %d\n",checker_ptr,line_number);
+                return false;
+            }
+            //checking there are no 2 free block not merge.
         
-        if (is_block_allocated(checker_ptr) == 0){
-            uint64_t* payload_ptr = get_payload_ptr(checker_ptr);
-            for (int i = 0; i < free_list_num; i ++){
-                node_t* current = freelist_heads[i];
-                while (current != NULL){
-                    if ((uint64_t*)current == payload_ptr){
-                        return true;
-                    }
-                    current = current->next;
-                }
+            if (is_block_allocated(checker_ptr) == 0
+                && (get_total_block_size(checker_ptr) != mini_block_size || is_mini_node_linkable(get_payload_ptr(checker_ptr)))){
+                heap_free_count++;
             }
-            printf("Free Block can not find in freelist. block at %p in line %d\n",checker_ptr,line_number);
+            //counting the free block, it will compare with the number of block in free list.
+            //A mini block too far to link is free but not in the list.
+        }
+        bool last_chunk = (*(chunk_pre - 1) == 0);
+        if ((last_chunk && checker_ptr != arena->heap_epi) || (FOOTERLESS && (is_prev_block_allocated(checker_ptr) != prev_alloc_status
+                                                                          || is_prev_block_mini(checker_ptr) != prev_mini_status))){
+            printf("Epilogue is not at the end of heap or its prev alloc bit is wrong in line %d\n",line_number);
             return false;
         }
-        //checking all the free block is in free list.
     }
 
 
-    //freelist array checker
-    for (int i = 0; i < free_list_num; i ++){
-        node_t* current = freelist_heads[i];
+    //freelist array checker, in TLSF mode list i is heads[i / tlsf_sl_count][i % tlsf_sl_count].
+    int list_num = TLSF ? tlsf_fl_count * tlsf_sl_count : free_list_num;
+    for (int i = 0; i < list_num; i ++){
+        node_t* current;
+        if (TLSF){
+            int fl = i / tlsf_sl_count;
+            int sl = i % tlsf_sl_count;
+            current = arena->tlsf_control->heads[fl][sl];
+            if ((current != NULL) != ((arena->tlsf_control->sl_bitmap[fl] >> sl) & 1)
+                || (arena->tlsf_control->sl_bitmap[fl] != 0) != ((arena->tlsf_control->fl_bitmap >> fl) & 1)){
+                printf("TLSF bitmap is not sync with the list, list %d %d in line %d\n",fl,sl,line_number);
+                return false;
+            }
+        }
+        else{
+            current = arena->freelist_heads[i];
+            if ((current != NULL) != ((arena->freelist_bitmap >> i) & 1)){
+                printf("Freelist bitmap is not sync with the list, list %d in line %d\n",i,line_number);
+                return false;
+            }
+            if (i == large_tree_index){
+                large_tree_node_t* last_node = NULL;
+                if (large_tree_check((large_tree_node_t*) current, &last_node, &heap_free_count, line_number) < 0){
+                    return false;
+                }
+                continue;
+                //The last list is the large block tree, it has its own checker.
+            }
+        }
         while (current != NULL){
-            if(current->next != NULL){
-                if(current->next->prev != current){
+            if(get_next_node(current) != NULL){
+                if(get_prev_node(get_next_node(current)) != current){
                     printf("Block in freelist prev and next ptr is not ok, block at %p in line %d\n",get_header_ptr((uint64_t*)current),line_number);
                     return false;
                 }
@@ -621,7 +3024,13 @@ bool mm_checkheap(int line_number)
                 printf("Block in freelist, but its header not set to free, block at %p in line %d\n",get_header_ptr((uint64_t*)current),line_number);
                 return false;
             }
-            if(go_which_range_freelist(get_total_block_size(get_header_ptr((uint64_t*)current))) != i){
+            int list_index = go_which_range_freelist(get_total_block_size(get_header_ptr((uint64_t*)current)));
+            if (TLSF){
+                int fl, sl;
+                tlsf_mapping_insert(get_total_block_size(get_header_ptr((uint64_t*)current)), &fl, &sl);
+                list_index = fl * tlsf_sl_count + sl;
+            }
+            if(list_index != i){
                 printf("Block is in wrong interval freelist, block at %p in line %d\n",get_header_ptr((uint64_t*)current),line_number);
                 return false;
             }
@@ -629,9 +3038,86 @@ bool mm_checkheap(int line_number)
                 printf("Block is not in heap, block at %p in line %d\n",get_header_ptr((uint64_t*)current),line_number);
                 return false;
             }
-            current = current->next;
+            heap_free_count--;
+            current = get_next_node(current);
+        }
+    }
+    for (mini_free_node_t* mini = arena->mini_freelist_head; mini != NULL; mini = mini_link_to_node(mini->next)){
+        uint64_t* mini_header = get_header_ptr((uint64_t*)mini);
+        if (is_block_allocated(mini_header) != 0 || get_total_block_size(mini_header) != mini_block_size || in_heap(mini) == false
+            || (mini->next != 0 && mini_link_to_node(mini_link_to_node(mini->next)->prev) != mini)){
+            printf("Block in mini freelist is not a free mini block, block at %p in line %d\n",mini_header,line_number);
+            return false;
+        }
+        heap_free_count--;
+    }
+    //mini freelist checker
+
+    for (int i = 0; QUICK_LIST_LIMIT > 0 && i < quick_list_num; i++){
+        uint32_t quick_count = 0;
+        for (mini_node_t* quick_block = arena->small_control->quick_heads[i]; quick_block != NULL; quick_block = quick_block->next){
+            uint64_t* quick_header = get_header_ptr((uint64_t*)quick_block);
+            if (is_block_allocated(quick_header) == 0 || quick_list_index(get_total_block_size(quick_header)) != i || in_heap(quick_block) == false){
+                printf("Block in quick list is not an allocated block of its size, block at %p in line %d\n",quick_header,line_number);
+                return false;
+            }
+            quick_count++;
+        }
+        if (quick_count != arena->small_control->quick_counts[i] || quick_count > QUICK_LIST_LIMIT
+            || (quick_count != 0) != ((arena->small_control->quick_bitmap >> i) & 1)){
+            printf("Quick list count or bitmap is wrong, list %d in line %d\n",i,line_number);
+            return false;
+        }
+    }
+    //quick list checker, blocks in it are allocated, so they are not counted as free blocks.
+
+    for (int i = 0; tcache_enabled && tcache != NULL && i < tcache_bin_num; i++){
+        uint32_t cached_count = 0;
+        for (mini_node_t* cached_block = tcache->heads[i]; cached_block != NULL; cached_block = cached_block->next){
+            uint64_t* cached_header = get_header_ptr((uint64_t*)cached_block);
+            if (is_block_allocated(cached_header) == 0 || tcache_bin_index(get_total_block_size(cached_header)) != i || in_heap(cached_block) == false){
+                printf("Block in thread cache is not an allocated block of its size, block at %p in line %d\n",cached_header,line_number);
+                return false;
+            }
+            cached_count++;
+        }
+        if (cached_count != tcache->counts[i] || cached_count > TCACHE_COUNT){
+            printf("Thread cache count is wrong, bin %d in line %d\n",i,line_number);
+            return false;
+        }
+    }
+    //thread cache checker, only the cache of this thread can be checked.
+
+    for (mini_node_t* remote_block = __atomic_load_n(&arena->remote_free_head, __ATOMIC_ACQUIRE); remote_block != NULL; remote_block = remote_block->next){
+        uint64_t* remote_header = get_header_ptr((uint64_t*)remote_block);
+        if (is_block_allocated(remote_header) == 0 || in_heap(remote_block) == false
+            || (*remote_header & ((uint64_t)arena_index_mask << arena_index_shift)) != arena->header_bits){
+            printf("Block in remote free stack is not an allocated block of this arena, block at %p in line %d\n",remote_header,line_number);
+            return false;
+        }
+    }
+    //remote free stack checker, other threads only push on the top, the blocks under the head we read do not change while we hold the lock.
+
+    for (int i = 0; SLAB && i < slab_class_num; i++){
+        for (slab_run_t* run = arena->small_control->slab_heads[i]; run != NULL; run = run->next){
+            uint32_t free_slots = 0;
+            for (int j = 0; j < slab_bitmap_words; j++){
+                free_slots += __builtin_popcountll(run->free_bitmap[j]);
+            }
+            if (get_slab_run(run) != run || run->class_index != (uint32_t)i || run->free_count == 0
+                || run->free_count != free_slots || (run->next != NULL && run->next->prev != run)){
+                printf("Slab run is not in run map, or its free count is wrong, run at %p in line %d\n",run,line_number);
+                return false;
+            }
         }
     }
+    //slab run checker, a run in the list must have a free slot and its bitmap agrees with the free count.
+
+    if (heap_free_count != 0){
+        printf("Free Block can not find in freelist, or freelist has extra block in line %d\n",line_number);
+        return false;
+    }
+    //checking all the free block is in free list.
 
 #endif // DEBUG
     return true;
@@ -8,6 +8,13 @@ extern void* mm_malloc (size_t size);
 extern void mm_free (void* ptr);
 extern void* mm_realloc(void* ptr, size_t size);
 extern void* mm_calloc (size_t nmemb, size_t size);
+extern void* mm_memalign (size_t alignment, size_t size);
+extern void* mm_aligned_alloc (size_t alignment, size_t size);
+extern int mm_posix_memalign (void** memptr, size_t alignment, size_t size);
+extern void mm_free_sized (void* ptr, size_t size);
+extern size_t mm_malloc_usable_size (void* ptr);
+extern size_t mm_malloc_batch (size_t size, size_t n, void** out);
+extern void mm_free_batch (void** ptrs, size_t n);
 
 #else
 
@@ -16,6 +23,13 @@ extern void* malloc (size_t size);
 extern void free (void* ptr);
 extern void* realloc(void* ptr, size_t size);
 extern void* calloc (size_t nmemb, size_t size);
+extern void* memalign (size_t alignment, size_t size);
+extern void* aligned_alloc (size_t alignment, size_t size);
+extern int posix_memalign (void** memptr, size_t alignment, size_t size);
+extern void free_sized (void* ptr, size_t size);
+extern size_t malloc_usable_size (void* ptr);
+extern size_t malloc_batch (size_t size, size_t n, void** out);
+extern void free_batch (void** ptrs, size_t n);
 
 #endif
 